@@ -21,6 +21,17 @@
 
 #include <time.h>
 #include <math.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
 
 /* For htons and htonl
 #include <arpa/inet.h>
@@ -62,11 +73,16 @@ sig = .FIT
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef signed char i8;
+typedef int i32;
 
 /* Some global variables.
+ * The ones that belong to the parser are per-thread (__thread)
+ * so that batch modes can read several files at once.
+ * For the ordinary one-file-per-run case this makes no difference.
  */
-int fit_fd;
-int record_count;
+__thread int fit_fd;
+__thread int record_count;
 int dump_level = 0;
 
 /* We get a 16 byte thing without the packed attribute */
@@ -81,39 +97,34 @@ struct __attribute__((__packed__)) fit_header {
 	u16 crc;
 };
 
-struct fit_header hdr;
+__thread struct fit_header hdr;
 
 /* --------------------------------------------------------------------- */
 /* --------------------------------------------------------------------- */
 
-struct global {
-	int id;
-	char *name;
-};
-
-/* This is incomplete.  I have only the global ID entries
- * that I see in the FIT file from my Garmin 66i.
- * So, "it works for me".
- */
-struct global ginfo[] = {
-    { 0, "file ID" },
-    { 49, "file creator" },
-    { 23, "device info" },
-    { 20, "record" },
-    { 21, "event" },
-    { 19, "lap" },
-    { 18, "session" },
-    { 34, "activity" },
-    { 0, NULL }
-};
+/* This used to be a little table of just the global IDs
+ * that I see in the FIT file from my Garmin 66i, and anything
+ * else was an "Alligator attack".  Files from other devices
+ * have all sorts of other messages, so now we have the
+ * message list from the FIT profile, and whatever we still
+ * don't know about just gets skipped.
+ */
+#include "profile.h"
 
 /* These are what carry all the data we care about */
 #define GID_RECORD	20
 
+/* Batch modes don't want one bad file to kill the whole run.
+ * They set oops_jmp and get control back here instead.
+ */
+__thread jmp_buf *oops_jmp;
+
 void
 oops ( char *msg )
 {
 	fprintf ( stderr, "%s\n", msg );
+	if ( oops_jmp )
+	    longjmp ( *oops_jmp, 1 );
 	exit ( 1 );
 }
 
@@ -124,69 +135,217 @@ oops ( char *msg )
 #define H_XXX		0x10	/* --- */
 #define H_ID		0x0f	/* ID mask */
 
+/* The biggest definition message there can be:
+ * 6 byte header, 255 fields, dev count, 255 dev fields.
+ */
+#define DEF_MAX		(6 + 255*3 + 1 + 255*3)
+
+/* The biggest message there can be, data or definition:
+ * header byte, 255 fields of up to 255 bytes,
+ * then the same again in developer fields.
+ */
+#define MSG_MAX		(1 + 2*255*255)
+
 struct __attribute__((__packed__)) field {
 	u8 id;
 	u8 size;
 	u8 type;
 };
 
-struct definition {
+/* A record layout with a fast path decoder (see below) */
+struct layout {
+	char *name;
+	int gid;
+	int nf;
+	struct field *field;
 	int size;
+	void (*decode) ( u8 * );
+	void (*decode_be) ( u8 * );	/* same, byte swapped */
+};
+
+struct definition {
+	int size;			/* including developer fields */
+	int dev_size;
 	int nf;
-	struct field field[100];	/* XXX */
-} def;
+	int gid;
+	int big;			/* big endian */
+	int ts_off;			/* offset of the timestamp, or -1 */
+	struct layout *fast;		/* fast path layout, if any */
+	void (*fast_decode) ( u8 * );	/* its decoder, for our endianness */
+	void (*decode) ( struct definition * );	/* generic decoder, ditto */
+	struct field field[255];
+};
+
+/* The 66i always sends a definition right before its data,
+ * but a file can have up to 16 of them active at once
+ * (merged files do), so we keep one for each local ID.
+ */
+#define NLOCAL		16
+
+__thread struct definition defs[NLOCAL];
+
+/* Compressed timestamp headers give the time relative to this,
+ * which is the last timestamp we saw in any message.
+ */
+__thread u32 last_ts;
 
-struct global *
+struct layout *layout_match ( int, struct definition * );
+void decode ( struct definition * );
+void decode_be ( struct definition * );
+
+/* Both of these are just an array index */
+struct pmesg *
 global_lookup ( int gid )
 {
-	struct global *gp;
-
-	gp = ginfo;
+	if ( gid < NPROFILE && profile[gid].name )
+	    return &profile[gid];
+	return NULL;
+}
 
-	while ( gp->name ) {
-	    if ( gp->id == gid )
-		return gp;
-	    gp++;
-	}
+struct pfield *
+field_lookup ( struct pmesg *gp, int fid )
+{
+	if ( gp && fid < gp->nfield && gp->field[fid].name )
+	    return &gp->field[fid];
+	if ( fid == 253 )
+	    return &pf_timestamp;
+	if ( fid == 254 )
+	    return &pf_message_index;
 	return NULL;
 }
 
+char *
+global_name ( struct pmesg *gp, int gid )
+{
+	if ( gp )
+	    return gp->name;
+	if ( gid >= MESG_MFG_FIRST )
+	    return "manufacturer specific";
+	return "unknown";
+}
+
 /* ---------------------------------------------------------------------- */
 /* IO routines.
  * rather than pass "fd" all around, we call these.
  * also implement a 1 byte peek.
+ *
+ * These used to do a read() for every field and lseek()
+ * back and forth for the peek, which meant the input had
+ * to be a real file.  Now they go forward only, through a
+ * small buffer, so the input can be a pipe ("-" is stdin).
+ * The file CRC gets worked out on the fly as bytes go by,
+ * and check_crc() looks at it when we get to the end.
+ *
+ * Anybody who wants the raw bytes of a record (trim does)
+ * can ask for them to be captured as they are read.
+ *
+ * If in_mem is set, the file is already in memory (the batch
+ * reader put it there) and we take bytes from that instead.
+ * If in_pipe is set, another thread is reading the file for
+ * us, and in_buf points right into its chunks (see pipe_fill).
  */
 
-off_t
-ltell ( int fd )
-{
-	return lseek ( fd, (off_t) 0, SEEK_CUR );
-}
+#define IN_BUF		16384
+
+__thread u8 in_space[IN_BUF];
+__thread u8 *in_buf;		/* in_space, or a pipe chunk */
+__thread int in_pos;
+__thread int in_len;
+__thread u16 in_crc;		/* CRC of everything read so far */
 
-off_t
-fit_tell ( void )
+__thread u8 *in_mem;		/* whole file in memory */
+__thread long in_mem_len;
+__thread long in_mem_pos;
+
+__thread int in_pipe;
+int pipe_fill ( int );
+
+__thread u8 *cap_buf;		/* capture bytes here */
+__thread int cap_max;
+__thread int cap_len;
+
+static u16 fit_crc16 ( u8, u16 );
+
+void
+in_reset ( void )
 {
-	return ltell ( fit_fd );
+	in_buf = in_space;
+	in_pos = 0;
+	in_len = 0;
+	in_crc = 0;
+	in_mem_pos = 0;
+	cap_buf = NULL;
 }
 
-void
-fit_seek ( off_t pos )
+/* Try to have n bytes in the buffer, return how many we have */
+int
+in_fill ( int n )
 {
-	(void) lseek ( fit_fd, pos, SEEK_SET );
+	int nn;
+
+	if ( in_len - in_pos >= n )
+	    return n;
+
+	if ( in_pipe )
+	    return pipe_fill ( n );
+
+	memmove ( in_buf, &in_buf[in_pos], in_len - in_pos );
+	in_len -= in_pos;
+	in_pos = 0;
+
+	while ( in_len < n ) {
+	    if ( in_mem ) {
+		nn = in_mem_len - in_mem_pos;
+		if ( nn > IN_BUF - in_len )
+		    nn = IN_BUF - in_len;
+		memcpy ( &in_buf[in_len], &in_mem[in_mem_pos], nn );
+		in_mem_pos += nn;
+	    } else
+		nn = read ( fit_fd, &in_buf[in_len], IN_BUF - in_len );
+	    if ( nn <= 0 )
+		break;
+	    in_len += nn;
+	}
+
+	return in_len < n ? in_len : n;
 }
 
 int
 peek1 ( void )
 {
-	off_t pos;
-	int n;
-	u8 cbuf;
+	if ( in_fill ( 1 ) < 1 )
+	    oops ( "Premature end of file" );
 
-	pos = fit_tell ();
-	n = read ( fit_fd, &cbuf, 1 );
-	fit_seek ( pos );
+	return in_buf[in_pos];
+}
 
-	return cbuf;
+void
+readn ( u8 *buf, int nbuf )
+{
+	int i, n;
+	u8 *p;
+
+	while ( nbuf > 0 ) {
+	    n = in_fill ( nbuf < IN_BUF ? nbuf : IN_BUF );
+	    if ( n < 1 )
+		oops ( "Premature end of file" );
+
+	    p = &in_buf[in_pos];
+	    for ( i=0; i<n; i++ )
+		in_crc = fit_crc16 ( p[i], in_crc );
+
+	    if ( cap_buf ) {
+		if ( cap_len + n > cap_max )
+		    oops ( "Capture buffer too small" );
+		memcpy ( &cap_buf[cap_len], p, n );
+		cap_len += n;
+	    }
+
+	    memcpy ( buf, p, n );
+	    in_pos += n;
+	    buf += n;
+	    nbuf -= n;
+	}
 }
 
 int
@@ -194,7 +353,7 @@ read1 ( void )
 {
 	u8 cbuf;
 
-	(void) read ( fit_fd, &cbuf, 1 );
+	readn ( &cbuf, 1 );
 
 	return cbuf;
 }
@@ -204,7 +363,7 @@ read2 ( void )
 {
 	u16 sbuf;
 
-	(void) read ( fit_fd, &sbuf, 2 );
+	readn ( (u8 *) &sbuf, 2 );
 
 	return sbuf;
 }
@@ -214,17 +373,24 @@ read4 ( void )
 {
 	u32 ibuf;
 
-	(void) read ( fit_fd, &ibuf, 4 );
+	readn ( (u8 *) &ibuf, 4 );
 
 	return ibuf;
 }
 
 void
-readn ( u8 *buf, int nbuf )
+capture_start ( u8 *buf, int max )
 {
-	int n;
+	cap_buf = buf;
+	cap_max = max;
+	cap_len = 0;
+}
 
-	n = read ( fit_fd, buf, nbuf );
+int
+capture_end ( void )
+{
+	cap_buf = NULL;
+	return cap_len;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -333,25 +499,21 @@ fit_crc16 ( u8 data, u16 crc)
   return crc;
 }
 
+/* Called after the last record.
+ * The last two bytes are the CRC of everything before them,
+ * so once they go through the CRC should come out zero.
+ */
 void
 check_crc ( void )
 {
-	u8 data;
-	u16 crc = 0;
-	int n;
+	u8 cbuf[2];
 
-	for ( ;; ) {
-	    n = read ( fit_fd, &data, 1 );
-	    if ( n == 0 )
-		break;
-	    crc = fit_crc16 ( data, crc );
-	}
-	if ( dump_level > 1 )
-	    printf ( "CRC for entire file: %04x\n", crc );
+	readn ( cbuf, 2 );
 
-	lseek ( fit_fd, 0, SEEK_SET );
+	if ( dump_level > 1 )
+	    printf ( "CRC for entire file: %04x\n", in_crc );
 
-	if ( crc )
+	if ( in_crc )
 	    oops ( "Bad file CRC" );
 }
 
@@ -366,6 +528,116 @@ calc_crc ( u8 *buf, int n )
 	return crc;
 }
 
+/* Fast CRC over a block of memory, a byte at a time.
+ * For this (reflected) CRC, a byte table is just what
+ * fit_crc16() gives for each byte value starting from zero.
+ */
+u16 crc_table8[256];
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void
+crc_table_init ( void )
+{
+	int i;
+
+	for ( i=0; i<256; i++ )
+	    crc_table8[i] = fit_crc16 ( i, 0 );
+}
+
+u16
+crc_block ( u16 crc, u8 *buf, long n )
+{
+	long i;
+
+	pthread_once ( &crc_once, crc_table_init );
+
+	for ( i=0; i<n; i++ )
+	    crc = (crc >> 8) ^ crc_table8[(crc ^ buf[i]) & 0xff];
+	return crc;
+}
+
+/* Stitching CRCs together --
+ * This CRC is linear with no final xor, so the CRC of A+B is
+ * the CRC of A run over len(B) zero bytes, xor the CRC of B.
+ * Running over n zero bytes is a linear operator on the 16 bit CRC
+ * (a 16x16 matrix over GF(2)), and by squaring the operator for one
+ * zero bit we get operators for 1, 2, 4, 8 ... bytes and only
+ * need log(n) steps.  This is how zlib does crc32_combine().
+ * The one bit operator is the shift with the polynomial (0xA001)
+ * coming in when the low bit falls off.
+ */
+
+u16
+gf2_times ( u16 *mat, u16 vec )
+{
+	u16 sum = 0;
+
+	while ( vec ) {
+	    if ( vec & 1 )
+		sum ^= *mat;
+	    vec >>= 1;
+	    mat++;
+	}
+	return sum;
+}
+
+void
+gf2_square ( u16 *square, u16 *mat )
+{
+	int n;
+
+	for ( n=0; n<16; n++ )
+	    square[n] = gf2_times ( mat, mat[n] );
+}
+
+/* Run a CRC over n zero bytes */
+u16
+crc_zeros ( u16 crc, u32 n )
+{
+	u16 even[16];
+	u16 odd[16];
+	u16 row;
+	int i;
+
+	if ( n == 0 )
+	    return crc;
+
+	/* one zero bit */
+	odd[0] = 0xA001;
+	row = 1;
+	for ( i=1; i<16; i++ ) {
+	    odd[i] = row;
+	    row <<= 1;
+	}
+
+	gf2_square ( even, odd );	/* two zero bits */
+	gf2_square ( odd, even );	/* four zero bits */
+
+	/* The first square here gives one zero byte */
+	do {
+	    gf2_square ( even, odd );
+	    if ( n & 1 )
+		crc = gf2_times ( even, crc );
+	    n >>= 1;
+	    if ( ! n )
+		break;
+
+	    gf2_square ( odd, even );
+	    if ( n & 1 )
+		crc = gf2_times ( odd, crc );
+	    n >>= 1;
+	} while ( n );
+
+	return crc;
+}
+
+/* CRC of A+B from the CRC of A, the CRC of B and the length of B */
+u16
+crc_combine ( u16 crc_a, u16 crc_b, u32 len_b )
+{
+	return crc_zeros ( crc_a, len_b ) ^ crc_b;
+}
+
 void
 check_header_crc ( u8 *h, int size )
 {
@@ -402,8 +674,8 @@ struct __attribute__((__packed__)) def_hdr {
 	u8	nf;
 };
 
-struct def_hdr dhdr;
-struct global *gp;
+__thread struct def_hdr dhdr;
+__thread struct pmesg *gp;
 
 int
 definition_record ( void )
@@ -416,10 +688,13 @@ definition_record ( void )
 
 	int size;
 	int nf;
-	u8 nd;		/* It is critical that this be u8 */
+	u8 nd = 0;	/* It is critical that this be u8 */
 	int ndev = 0;
 
 	struct field ff;
+	struct definition *dp;
+	struct pfield *pf;
+	int dev_size = 0;
 
 	// printf ( "Sizeof def header = %d\n", sizeof(struct def_hdr) );
 	// n = read ( fd, (char *) &dhdr, sizeof(struct def_hdr) );
@@ -427,35 +702,42 @@ definition_record ( void )
 
 	/* This header ID is just a sequential count 0, 1, ... */
 	id = dhdr.header & H_ID;
+	dp = &defs[id];
 
 	if ( dump_level > 1 ) {
 	    printf ( "\n" );
 	    printf ( "Definition record, header = 0x%02x, header id = %d\n", dhdr.header, id );
 	}
 
+	/* The global ID follows the architecture byte */
+	if ( dhdr.endian )
+	    dhdr.g_id = (dhdr.g_id >> 8) | (dhdr.g_id << 8);
+
+	/* Messages we don't know about get skipped (by size) */
 	gp = global_lookup ( dhdr.g_id );
-	if ( ! gp ) {
-	    printf ( "gid = %d (0x%04x)\n", dhdr.g_id, dhdr.g_id );
-	    hex_dump ( (char *) &dhdr, sizeof(struct def_hdr) );
-	    oops ( "Alligator attack" );
-	}
 
 	if ( dump_level > 1 )
-	    printf ( "Definition record, global ID = %d -- %s\n", dhdr.g_id, gp->name );
+	    printf ( "Definition record, global ID = %d -- %s\n", dhdr.g_id, global_name ( gp, dhdr.g_id ) );
 
 	// printf ( "Sizeof field: %d\n", sizeof(struct field) );
 	nf = dhdr.nf;
 
 	size = 0;
+	dp->ts_off = -1;
 	for ( i=0; i<nf; i++ ) {
 	    // n = read ( fd, &ff, sizeof(struct field) );
 	    readn ( (u8 *) &ff, sizeof(struct field) );
-	    if ( dump_level > 1 )
-		printf ( "-- Field: %d, id, size, type = %d %d %d(0x%02x)\n", i, ff.id, ff.size, ff.type, ff.type );
+	    if ( ff.id == 253 && ff.size == 4 )	/* timestamp */
+		dp->ts_off = size;
+	    if ( dump_level > 1 ) {
+		pf = field_lookup ( gp, ff.id );
+		printf ( "-- Field: %d, id, size, type = %d %d %d(0x%02x)\t%s\n", i, ff.id, ff.size, ff.type, ff.type,
+		    pf ? pf->name : "?" );
+	    }
 	    size += ff.size;
-	    def.field[i] = ff;
+	    dp->field[i] = ff;
 	}
-	def.nf = nf;
+	dp->nf = nf;
 
 	/* We do see these!
 	 * We just read and discard.
@@ -473,17 +755,209 @@ definition_record ( void )
 		readn ( (u8 *) &ff, sizeof(struct field) );
 		if ( dump_level > 1 )
 		    printf ( "-- Dev Field: %d, id, size, type = %d %d %d\n", i, ff.id, ff.size, ff.type );
+		dev_size += ff.size;
 	    }
 	    ndev += nd*sizeof(struct field);
 	}
 
+	/* The developer field data comes along behind the rest,
+	 * we don't use it but we have to skip it.
+	 */
+	size += dev_size;
+
 	if ( dump_level > 1 )
 	    printf ( " expected record size will be %d bytes\n", size );
-	def.size = size;
+	dp->size = size;
+	dp->dev_size = dev_size;
+	dp->gid = dhdr.g_id;
+	dp->big = dhdr.endian;
+
+	/* Pick the decoders now, for this byte order, so nobody
+	 * has to look at dp->big for every field of every record.
+	 */
+	dp->decode = dp->big ? decode_be : decode;
+
+	/* Developer fields would throw the fixed offsets off */
+	dp->fast = NULL;
+	if ( ! nd )
+	    dp->fast = layout_match ( dhdr.g_id, dp );
+	if ( dp->fast )
+	    dp->fast_decode = dp->big ? dp->fast->decode_be : dp->fast->decode;
+	if ( dump_level > 1 && dhdr.g_id == GID_RECORD ) {
+	    if ( dp->fast )
+		printf ( " decode with fast path (%s layout%s)\n", dp->fast->name,
+		    dp->big ? ", big endian" : "" );
+	    else
+		printf ( " decode with generic path\n" );
+	}
 
 	return sizeof(struct def_hdr) + nf*sizeof(struct field) + ndev;
 }
 
+/* ---------------------------------------------------------------------- */
+/* Arenas --
+ *
+ * When indexing thousands of files, every file wants point storage
+ * that gets thrown away as soon as the file is done.  Doing that
+ * with malloc and realloc over and over (for weeks, if this ever
+ * runs as a server) is slow and chops the heap into little pieces.
+ *
+ * So a worker thread can have an arena instead.  Allocating just
+ * bumps a pointer, and arena_reset() throws everything away at
+ * once, ready for the next file.  The memory stays, so after the
+ * first few files there is no more asking the system for any.
+ * The FIT header tells us how big the file is, and arena_hint()
+ * uses that to make sure the first block is big enough for it all.
+ *
+ * Blocks come from mmap.  Big ones (ARENA_HUGE and up) try for
+ * huge pages (MAP_HUGETLB, which only works if some are reserved),
+ * and otherwise ask for transparent huge pages with madvise.
+ */
+
+#define ARENA_BLOCK	(256*1024)
+#define ARENA_HUGE	(2*1024*1024)
+#define ARENA_ALIGN	16
+
+struct arena_blk {
+	struct arena_blk *next;
+	long size;		/* all of it, including this header */
+	long used;
+};
+
+struct arena {
+	struct arena_blk *head;
+	struct arena_blk *cur;
+	u8 *last;		/* most recent allocation (for arena_realloc) */
+};
+
+#define ARENA_HDR	((sizeof(struct arena_blk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_blk *
+arena_block ( long size )
+{
+	struct arena_blk *bp;
+	long round;
+	void *p = MAP_FAILED;
+
+	size += ARENA_HDR;
+	if ( size < ARENA_BLOCK )
+	    size = ARENA_BLOCK;
+	round = size >= ARENA_HUGE ? ARENA_HUGE : 4096;
+	size = (size + round - 1) & ~(round - 1);
+
+	if ( size >= ARENA_HUGE )
+	    p = mmap ( NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	if ( p == MAP_FAILED ) {
+	    p = mmap ( NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	    if ( p == MAP_FAILED )
+		oops ( "Out of memory for arena" );
+	    if ( size >= ARENA_HUGE )
+		(void) madvise ( p, size, MADV_HUGEPAGE );
+	}
+
+	bp = p;
+	bp->next = NULL;
+	bp->size = size;
+	bp->used = ARENA_HDR;
+	return bp;
+}
+
+void *
+arena_alloc ( struct arena *ap, long n )
+{
+	struct arena_blk *bp, *lp;
+
+	n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	/* Blocks after cur are left over from some earlier file,
+	 * and get emptied as we get to them.
+	 */
+	lp = NULL;
+	for ( bp = ap->cur; bp && bp->used + n > bp->size; bp = bp->next ) {
+	    lp = bp;
+	    if ( bp->next )
+		bp->next->used = ARENA_HDR;
+	}
+
+	if ( ! bp ) {
+	    bp = arena_block ( n );
+	    if ( lp )
+		lp->next = bp;
+	    else
+		ap->head = bp;
+	}
+
+	ap->cur = bp;
+	ap->last = (u8 *) bp + bp->used;
+	bp->used += n;
+	return ap->last;
+}
+
+/* Like realloc.  If p was the last thing allocated, and there
+ * is room after it, it just gets bigger where it is.
+ */
+void *
+arena_realloc ( struct arena *ap, void *p, long old, long n )
+{
+	struct arena_blk *bp = ap->cur;
+	u8 *q;
+
+	if ( p && p == ap->last && (u8 *) p + n <= (u8 *) bp + bp->size ) {
+	    bp->used = ((u8 *) p - (u8 *) bp) + ((n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+	    return p;
+	}
+
+	q = arena_alloc ( ap, n );
+	if ( p )
+	    memcpy ( q, p, old < n ? old : n );
+	return q;
+}
+
+/* All gone, in one go */
+void
+arena_reset ( struct arena *ap )
+{
+	ap->cur = ap->head;
+	ap->last = NULL;
+	if ( ap->head )
+	    ap->head->used = ARENA_HDR;
+}
+
+/* Right after a reset, make sure the first block holds n bytes.
+ * A bigger block goes on the front, the old ones still get used
+ * when that fills up.
+ */
+void
+arena_hint ( struct arena *ap, long n )
+{
+	struct arena_blk *bp;
+
+	if ( ap->cur != ap->head || (ap->head && ap->head->used != ARENA_HDR) )
+	    return;
+	if ( ap->head && ap->head->size - ARENA_HDR >= n )
+	    return;
+
+	bp = arena_block ( n );
+	bp->next = ap->head;
+	ap->head = ap->cur = bp;
+}
+
+void
+arena_free ( struct arena *ap )
+{
+	struct arena_blk *bp, *np;
+
+	for ( bp = ap->head; bp; bp = np ) {
+	    np = bp->next;
+	    munmap ( bp, bp->size );
+	}
+	ap->head = ap->cur = NULL;
+	ap->last = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
 /* Here is what the data "record" records from the 66i look like:
  * My sample file has 1175 of these
 
@@ -517,21 +991,164 @@ definition_record ( void )
 
  */
 
+#define M2F	3.280839895
+
 struct data {
 	u32	time;
+	u8	gap;		/* first point after a gap (resampling) */
 	double lon;
 	double lat;
 	double alt;
 	double temp;
 	double speed;
 	double distance;
+	double salt;		/* smoothed altitude (see smoothing) */
+};
+
+/* With -q we keep points the way the device gave them to us,
+ * as scaled integers, and only turn them into doubles when
+ * somebody asks for one (see get_point).
+ * The decoder hands the raw values straight to store_raw,
+ * so nothing gets converted until it is needed.
+ * This is 28 bytes per point rather than 56.
+ * Everything is as wide as the FIT field, so the "invalid"
+ * values (no altitude and so on) come back as themselves.
+ * Resampled points get rounded to what the device could have said.
+ */
+struct qdata {
+	u32	time;
+	i32	lat;		/* semicircles */
+	i32	lon;
+	i32	distance;	/* centimeters */
+	i32	alt;		/* (meters + 500) * 5 */
+	i32	speed;		/* mm/s */
+	i8	temp;		/* degrees C */
+	u8	gap;
 };
 
-/* XXX - bogus limit on points */
+int quantize = 0;
+
+/* This started life as a fixed array of 5000 points.
+ * Now it starts there and grows as needed.
+ * Only one of data[] or qdata[] gets used, depending on -q
+ */
 #define MAX_DATA	5000
 
-struct data data[MAX_DATA];
-int ndata = 0;
+__thread struct data *data;
+__thread struct qdata *qdata;
+__thread int ndata = 0;
+__thread int max_data = 0;
+
+/* If a thread sets data_arena, the points come from there,
+ * and header() sets data_hint to about how many there will be.
+ */
+#define HINT_BYTES	16	/* file bytes per point, at least */
+
+__thread struct arena *data_arena;
+__thread int data_hint;
+
+void
+data_grow ( void )
+{
+	int nmax;
+	long size;
+
+	nmax = max_data ? max_data * 2 : MAX_DATA;
+	if ( data_arena ) {
+	    if ( nmax < data_hint )
+		nmax = data_hint;
+	    if ( quantize ) {
+		size = sizeof(struct qdata);
+		qdata = arena_realloc ( data_arena, qdata, max_data * size, nmax * size );
+	    } else {
+		size = sizeof(struct data);
+		data = arena_realloc ( data_arena, data, max_data * size, nmax * size );
+	    }
+	} else if ( quantize ) {
+	    qdata = realloc ( qdata, nmax * sizeof(struct qdata) );
+	    if ( ! qdata )
+		oops ( "Out of memory for data" );
+	} else {
+	    data = realloc ( data, nmax * sizeof(struct data) );
+	    if ( ! data )
+		oops ( "Out of memory for data" );
+	}
+	max_data = nmax;
+}
+
+double cc2deg ( int );
+void unpack_point ( struct qdata *, struct data * );
+
+/* Undo the conversions in make_point.
+ * Only points that somebody made up (the resampler, the smoother)
+ * come through here, the decoder uses store_raw.
+ */
+void
+pack_point ( struct data *dp, struct qdata *qp )
+{
+	qp->time = dp->time;
+	qp->gap = dp->gap;
+	qp->lat = lround ( dp->lat * 0x80000000U / 180.0 );
+	qp->lon = lround ( dp->lon * 0x80000000U / 180.0 );
+	qp->alt = llround ( (dp->alt / M2F + 500.0) * 5.0 );
+	qp->speed = llround ( dp->speed / 2.23694 * 1000.0 );
+	qp->temp = lround ( (dp->temp - 32.0) / 1.8 );
+	qp->distance = llround ( dp->distance * 5280.0 / M2F * 100.0 );
+}
+
+/* With -q and nothing in the way, the decoder comes here */
+void
+store_raw ( u32 time, int lat, int lon, int alt_raw, int temp_raw, int speed_raw, int dist_raw )
+{
+	struct qdata *qp;
+
+	if ( ndata >= max_data )
+	    data_grow ();
+	qp = &qdata[ndata++];
+	qp->time = time;
+	qp->gap = 0;
+	qp->lat = lat;
+	qp->lon = lon;
+	qp->alt = alt_raw;
+	qp->speed = speed_raw;
+	qp->temp = temp_raw;
+	qp->distance = dist_raw;
+}
+
+/* Every decoded point goes to point_sink.
+ * Normally that just puts it in data[], but other things
+ * (like the resampler) can get in the middle.
+ */
+void
+store_point ( struct data *dp )
+{
+	if ( ndata >= max_data )
+	    data_grow ();
+	if ( quantize )
+	    pack_point ( dp, &qdata[ndata++] );
+	else
+	    data[ndata++] = *dp;
+}
+
+/* Everybody who wants a stored point should ask here.
+ * Usually this is just a pointer into data[], but with -q
+ * the point gets unpacked into *tmp.
+ */
+struct data *
+get_point ( int i, struct data *tmp )
+{
+	if ( ! quantize )
+	    return &data[i];
+	unpack_point ( &qdata[i], tmp );
+	return tmp;
+}
+
+void (*point_sink) ( struct data * ) = store_point;
+
+/* Somebody who wants the raw values (like the archiver)
+ * can set this, and gets them instead of a point.
+ */
+void (*raw_sink) ( u32, int, int, int, int, int, int );
 
 /* Garmin uses an angular unit the call "semicircles".
  * The basic idea is that 2*pi radians uses all of the 32 bit resolution.
@@ -590,31 +1207,6 @@ tstamp ( u32 gtime )
  *  53 (fract cadence) is always 0xff
  */
 
-void
-decode ( struct definition *dp )
-{
-	int i;
-	struct field *fp;
-	int val;
-	int lon;
-	int lat;
-	u32 time;
-	double alt;
-	double temp, speed, dist;
-
-	for ( i=0; i<dp->nf; i++ ) {
-	    fp = &dp->field[i];
-	    if ( fp->size == 1 )
-		val = read1 ();
-	    else if ( fp->size == 2 )
-		val = read2 ();
-	    else if ( fp->size == 4 )
-		val = read4 ();
-	    else
-		oops ( "Turkey riot" );
-
-	    // printf ( "%d %5d %d %02x = %d\n", i, fp->id, fp->size, fp->type, val );
-
 #define TS_ID		253
 #define LAT_ID		0
 #define LON_ID		1
@@ -623,38 +1215,92 @@ decode ( struct definition *dp )
 #define SPEED_ID	73
 #define DIST_ID		5
 
-#define M2F	3.280839895
+/* A field that isn't there is the same as one with the FIT
+ * invalid value, so that is what we start with.
+ */
+#define NO_LATLON	0x7fffffff
+#define NO_U32		-1		/* 0xffffffff */
+#define NO_TEMP		0x7f		/* sint8 */
+
+/* The values we can decode, for -c (see col_arg).
+ * Only the ones in dec_mask get pulled out of a record
+ * and converted, the rest get skipped over (and left zero).
+ * The timestamp always gets read, compressed headers need it.
+ */
+#define C_TIME		0x01
+#define C_LON		0x02
+#define C_LAT		0x04
+#define C_ALT		0x08
+#define C_TEMP		0x10
+#define C_SPEED		0x20
+#define C_DIST		0x40
+#define C_ALL		0x7f
+#define C_SALT		0x80		/* just for -c, it comes from alt */
+
+int dec_mask = C_ALL;
 
-	    // if ( fp->id == 53 )
-	    // 	printf ( "53 = %08x\n", val );
+int
+field_col ( int id )
+{
+	if ( id == TS_ID )
+	    return C_TIME;
+	if ( id == LAT_ID )
+	    return C_LAT;
+	if ( id == LON_ID )
+	    return C_LON;
+	if ( id == ALT_ID )
+	    return C_ALT;
+	if ( id == TEMP_ID )
+	    return C_TEMP;
+	if ( id == SPEED_ID )
+	    return C_SPEED;
+	if ( id == DIST_ID )
+	    return C_DIST;
+	return 0;
+}
 
-	    if ( fp->id == TS_ID )
-		time = val;
-	    if ( fp->id == LAT_ID )
-		lat = val;
-	    if ( fp->id == LON_ID )
-		lon = val;
-	    if ( fp->id == ALT_ID )
-		alt = val;
-	    if ( fp->id == TEMP_ID )
-		temp = val * 1.8 + 32.0;
-	    if ( fp->id == SPEED_ID )
-		speed = val / 1000.0;
-	    if ( fp->id == DIST_ID )
-		dist = val / 100.0;
+/* Turn raw values into the units we like (feet, mph, miles, F)
+ */
+void
+convert_point ( struct data *dp, int lat, int lon, double alt_raw, int temp_raw, double speed_raw, double dist_raw )
+{
+	double alt;
+	double temp, speed, dist;
+
+	if ( dec_mask != C_ALL ) {
+	    dp->lon = dp->lat = dp->alt = 0.0;
+	    dp->temp = dp->speed = dp->distance = 0.0;
+	    if ( dec_mask & C_LON )
+		dp->lon = cc2deg(lon);
+	    if ( dec_mask & C_LAT )
+		dp->lat = cc2deg(lat);
+	    if ( dec_mask & C_ALT )
+		dp->alt = (alt_raw/5.0 - 500.0) * M2F;
+	    if ( dec_mask & C_TEMP )
+		dp->temp = temp_raw * 1.8 + 32.0;
+	    if ( dec_mask & C_SPEED )
+		dp->speed = speed_raw / 1000.0 * 2.23694;
+	    if ( dec_mask & C_DIST )
+		dp->distance = dist_raw / 100.0 * M2F / 5280.0;
+	    dp->salt = dp->alt;
+	    return;
 	}
 
 	/* Note: with no temperature sensor available we get a
 	 * raw value of 0x7f (127) which scales to 260.6
 	 */
+	temp = temp_raw * 1.8 + 32.0;
 
+	alt = alt_raw;
 	alt = alt/5.0 - 500.0;
 	alt *= M2F;
 
 	/* Convert from m/s to miles/hour */
+	speed = speed_raw / 1000.0;
 	speed *= 2.23694;
 
 	/* Convert meters to miles */
+	dist = dist_raw / 100.0;
 	dist *= M2F;
 	dist /= 5280.0;
 
@@ -663,42 +1309,432 @@ decode ( struct definition *dp )
 
 	// printf ( "   lon, lat, alt = %.5f %.5f %.2f\n", cc2deg(lon), cc2deg(lat), alt );
 
-	if ( ndata >= MAX_DATA )
-	    oops ( "Too much data" );
+	dp->lon = cc2deg(lon);
+	dp->lat = cc2deg(lat);
+	dp->alt = alt;
+	dp->temp = temp;
+	dp->speed = speed;
+	dp->distance = dist;
+	dp->salt = alt;
+}
+
+void
+unpack_point ( struct qdata *qp, struct data *dp )
+{
+	dp->time = qp->time;
+	dp->gap = qp->gap;
+	convert_point ( dp, qp->lat, qp->lon, qp->alt, qp->temp, qp->speed, qp->distance );
+}
+
+/* If this is set, it says where make_point should build the next
+ * point, so the sink can keep it right there without copying it
+ * (the pipeline does this, see pipe_slot).
+ */
+struct data *(*point_here) ( void );
+
+/* Turn raw values into a point and send it along.
+ * Both the generic decode() and the fast path end up here.
+ */
+void
+make_point ( u32 time, int lat, int lon, int alt_raw, int temp_raw, int speed_raw, int dist_raw )
+{
+	struct data pt, *dp;
+
+	if ( raw_sink ) {
+	    raw_sink ( time, lat, lon, alt_raw, temp_raw, speed_raw, dist_raw );
+	    return;
+	}
+	if ( quantize && point_sink == store_point ) {
+	    store_raw ( time, lat, lon, alt_raw, temp_raw, speed_raw, dist_raw );
+	    return;
+	}
+
+	dp = point_here ? point_here () : &pt;
+	dp->time = time;
+	dp->gap = 0;
+	convert_point ( dp, lat, lon, alt_raw, temp_raw, speed_raw, dist_raw );
+	point_sink ( dp );
+}
+
+/* The generic way, one field at a time.
+ * Fields of sizes we don't deal with just get skipped.
+ *
+ * A definition can say its data is big endian, so there are
+ * two of these, decode() and decode_be(), made from this one
+ * with big as a constant.  The compiler throws away the
+ * branches on big, and neither one has to think about it.
+ */
+static inline __attribute__((always_inline)) void
+decode_fields ( struct definition *dp, int big )
+{
+	int i;
+	struct field *fp;
+	int val;
+	int lon = NO_LATLON;
+	int lat = NO_LATLON;
+	u32 time = last_ts;
+	int alt = NO_U32;
+	int temp = NO_TEMP, speed = NO_U32, dist = NO_U32;
+	u8 junk[255];
+
+	for ( i=0; i<dp->nf; i++ ) {
+	    fp = &dp->field[i];
+	    if ( fp->id != TS_ID && ! (dec_mask & field_col ( fp->id )) ) {
+		readn ( junk, fp->size );
+		continue;
+	    }
+	    if ( fp->size == 1 )
+		val = read1 ();
+	    else if ( fp->size == 2 )
+		val = big ? __builtin_bswap16 ( read2 () ) : read2 ();
+	    else if ( fp->size == 4 )
+		val = big ? __builtin_bswap32 ( read4 () ) : read4 ();
+	    else {
+		readn ( junk, fp->size );
+		continue;
+	    }
+
+	    // printf ( "%d %5d %d %02x = %d\n", i, fp->id, fp->size, fp->type, val );
+
+	    // if ( fp->id == 53 )
+	    // 	printf ( "53 = %08x\n", val );
+
+	    if ( fp->id == TS_ID )
+		time = last_ts = val;
+	    if ( fp->id == LAT_ID )
+		lat = val;
+	    if ( fp->id == LON_ID )
+		lon = val;
+	    if ( fp->id == ALT_ID )
+		alt = val;
+	    if ( fp->id == TEMP_ID )
+		temp = val;
+	    if ( fp->id == SPEED_ID )
+		speed = val;
+	    if ( fp->id == DIST_ID )
+		dist = val;
+	}
+
+	for ( i=dp->dev_size; i>0; i -= sizeof(junk) )
+	    readn ( junk, i < sizeof(junk) ? i : sizeof(junk) );
+
+	make_point ( time, lat, lon, alt, temp, speed, dist );
+}
+
+void
+decode ( struct definition *dp )
+{
+	decode_fields ( dp, 0 );
+}
+
+void
+decode_be ( struct definition *dp )
+{
+	decode_fields ( dp, 1 );
+}
+
+/* ---------------------------------------------------------------------- */
+/* Fast path --
+ *
+ * Just about every record I decode has exactly the layout shown
+ * up above (14 fields, 40 bytes).  For the layouts we know about,
+ * the table below gets turned (at compile time) into a packed struct
+ * and a decoder that pulls the fields out at fixed offsets.
+ * definition_record() hooks a decoder up when a definition matches
+ * a layout byte for byte, and then each record is one readn() plus
+ * a few loads, with no loop over the fields.
+ * Anything else goes through decode() as before.
+ *
+ * To add a layout, write a LAYOUT_xxx table, a DECODER(xxx)
+ * and add it to layouts[].  Every field ID used needs a GET_nn
+ * saying what to do with it (possibly nothing).
+ *
+ * Each layout gets two decoders, decode_xxx and decode_xxx_be.
+ * The second is for files with big endian definitions, and
+ * byte swaps each field as it loads it (bswap is one instruction),
+ * so those files get the fast path too.
+ */
+
+#define LAYOUT_66I(F) \
+	F ( 253, 4, 0x86 )	/* timestamp */ \
+	F (   0, 4, 0x85 )	/* lat */ \
+	F (   1, 4, 0x85 )	/* long */ \
+	F (   5, 4, 0x86 )	/* dist */ \
+	F (  14, 4, 0x86 )	/* ? */ \
+	F (  15, 4, 0x86 )	/* ? */ \
+	F (  73, 4, 0x86 )	/* enh speed */ \
+	F (  78, 4, 0x86 )	/* enh altitude */ \
+	F (   2, 2, 0x84 )	/* altitude */ \
+	F (   6, 2, 0x84 )	/* speed */ \
+	F (   3, 1, 0x02 )	/* heart rate */ \
+	F (   4, 1, 0x02 )	/* cadence */ \
+	F (  13, 1, 0x01 )	/* temperature */ \
+	F (  53, 1, 0x02 )	/* fractional cadence */
+
+#define GET_253(v)	time = (v)
+#define GET_0(v)	if ( dec_mask & C_LAT ) lat = (v)
+#define GET_1(v)	if ( dec_mask & C_LON ) lon = (v)
+#define GET_78(v)	if ( dec_mask & C_ALT ) alt = (v)
+#define GET_13(v)	if ( dec_mask & C_TEMP ) temp = (v)
+#define GET_73(v)	if ( dec_mask & C_SPEED ) speed = (v)
+#define GET_5(v)	if ( dec_mask & C_DIST ) dist = (v)
+#define GET_2(v)
+#define GET_3(v)
+#define GET_4(v)
+#define GET_6(v)
+#define GET_14(v)
+#define GET_15(v)
+#define GET_53(v)
+
+#define TYPE_1		u8
+#define TYPE_2		u16
+#define TYPE_4		u32
+
+#define SWAP_1(v)	(v)
+#define SWAP_2(v)	__builtin_bswap16 ( v )
+#define SWAP_4(v)	__builtin_bswap32 ( v )
+
+#define L_FIELD(id, size, type)		{ id, size, type },
+#define L_MEMBER(id, size, type)	TYPE_##size f_##id;
+#define L_GET(id, size, type)		GET_##id ( r->f_##id );
+#define L_GET_BE(id, size, type)	GET_##id ( SWAP_##size ( r->f_##id ) );
+
+#define DECODE_FN(fn, name, get) \
+void \
+fn ( u8 *buf ) \
+{ \
+	struct rec_##name *r = (struct rec_##name *) buf; \
+	u32 time = last_ts; \
+	int lat = NO_LATLON, lon = NO_LATLON; \
+	int alt = NO_U32, temp = NO_TEMP, speed = NO_U32, dist = NO_U32; \
+\
+	LAYOUT_##name ( get ) \
+	last_ts = time; \
+	make_point ( time, lat, lon, alt, temp, speed, dist ); \
+}
+
+#define DECODER(name) \
+struct __attribute__((__packed__)) rec_##name { LAYOUT_##name ( L_MEMBER ) }; \
+\
+struct field fields_##name[] = { LAYOUT_##name ( L_FIELD ) }; \
+\
+DECODE_FN ( decode_##name, name, L_GET ) \
+DECODE_FN ( decode_##name##_be, name, L_GET_BE )
+
+DECODER ( 66I )
+
+_Static_assert ( sizeof(struct rec_66I) == 40, "66i layout should be 40 bytes" );
+
+/* What fit66 -u writes, just the fields we use */
+#define LAYOUT_F66(F) \
+	F ( 253, 4, 0x86 )	/* timestamp */ \
+	F (   0, 4, 0x85 )	/* lat */ \
+	F (   1, 4, 0x85 )	/* long */ \
+	F (   5, 4, 0x86 )	/* dist */ \
+	F (  73, 4, 0x86 )	/* enh speed */ \
+	F (  78, 4, 0x86 )	/* enh altitude */ \
+	F (  13, 1, 0x01 )	/* temperature */
+
+DECODER ( F66 )
+
+/* What fit66 -z makes of a 66i record, with a compressed timestamp.
+ * (When the time doesn't fit, the timestamp goes in front
+ * and it looks just like the f66 layout.)
+ */
+#define LAYOUT_66Z(F) \
+	F (   0, 4, 0x85 )	/* lat */ \
+	F (   1, 4, 0x85 )	/* long */ \
+	F (   5, 4, 0x86 )	/* dist */ \
+	F (  73, 4, 0x86 )	/* enh speed */ \
+	F (  78, 4, 0x86 )	/* enh altitude */ \
+	F (  13, 1, 0x01 )	/* temperature */
+
+DECODER ( 66Z )
+
+#define LAYOUT(label, name) \
+    { label, GID_RECORD, sizeof(fields_##name) / sizeof(struct field), \
+	fields_##name, sizeof(struct rec_##name), decode_##name, decode_##name##_be }
+
+struct layout layouts[] = {
+    LAYOUT ( "66i", 66I ),
+    LAYOUT ( "f66", F66 ),
+    LAYOUT ( "66i re-encoded", 66Z ),
+    { NULL }
+};
+
+/* How many records went each way (for -d and -m) */
+__thread int n_fast;
+__thread int n_generic;
+
+struct layout *
+layout_match ( int gid, struct definition *dp )
+{
+	struct layout *lp;
+
+	for ( lp = layouts; lp->name; lp++ ) {
+	    if ( lp->gid == gid && lp->nf == dp->nf &&
+		    memcmp ( lp->field, dp->field, dp->nf * sizeof(struct field) ) == 0 )
+		return lp;
+	}
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* For -d, show what is in messages other than records,
+ * with names and scaling from the profile.
+ */
+
+/* FIT base types, by the low 5 bits of the type */
+struct base_type {
+	int size;
+	int sign;
+	unsigned long invalid;
+};
+
+struct base_type base_types[] = {
+    [0] = { 1, 0, 0xff },		/* enum */
+    [1] = { 1, 1, 0x7f },		/* sint8 */
+    [2] = { 1, 0, 0xff },		/* uint8 */
+    [3] = { 2, 1, 0x7fff },		/* sint16 */
+    [4] = { 2, 0, 0xffff },		/* uint16 */
+    [5] = { 4, 1, 0x7fffffff },		/* sint32 */
+    [6] = { 4, 0, 0xffffffff },		/* uint32 */
+    [7] = { 1, 0, 0 },			/* string */
+    [8] = { 4, 0, 0xffffffff },		/* float32 */
+    [9] = { 8, 0, 0xffffffffffffffff },	/* float64 */
+    [10] = { 1, 0, 0 },			/* uint8z */
+    [11] = { 2, 0, 0 },			/* uint16z */
+    [12] = { 4, 0, 0 },			/* uint32z */
+    [13] = { 1, 0, 0xff },		/* byte */
+    [14] = { 8, 1, 0x7fffffffffffffff },	/* sint64 */
+    [15] = { 8, 0, 0xffffffffffffffff },	/* uint64 */
+    [16] = { 8, 0, 0 },			/* uint64z */
+};
+
+#define NBASE	(sizeof(base_types) / sizeof(struct base_type))
+#define BT_STRING	7
+#define BT_FLOAT32	8
+#define BT_FLOAT64	9
+
+void
+dump_fields ( struct definition *dp, u8 *buf )
+{
+	struct pmesg *mp;
+	struct pfield *pf;
+	struct field *fp;
+	struct base_type *bt;
+	unsigned long raw;
+	double val;
+	float fval;
+	int bits;
+	int bn;
+	u8 *p;
+	int i, j;
+
+	mp = global_lookup ( dp->gid );
+
+	p = buf;
+	for ( i=0; i<dp->nf; i++ ) {
+	    fp = &dp->field[i];
+	    pf = field_lookup ( mp, fp->id );
+	    bn = fp->type & 0x1f;
+	    bt = bn < NBASE ? &base_types[bn] : NULL;
+
+	    printf ( "   %s (%d) = ", pf ? pf->name : "?", fp->id );
+
+	    /* Strings, then arrays and oddballs, just get shown */
+	    if ( bn == BT_STRING ) {
+		printf ( "\"%.*s\"\n", (int) strnlen ( (char *) p, fp->size ), p );
+		p += fp->size;
+		continue;
+	    }
+	    if ( ! bt || fp->size != bt->size ) {
+		hex_dump ( p, fp->size );
+		p += fp->size;
+		continue;
+	    }
+
+	    raw = 0;
+	    for ( j=0; j<fp->size; j++ )
+		raw |= (unsigned long) p[j] << 8 * (dp->big ? fp->size-1-j : j);
+	    p += fp->size;
+
+	    if ( raw == bt->invalid ) {
+		printf ( "(invalid)\n" );
+		continue;
+	    }
+
+	    if ( pf && pf->units && strcmp ( pf->units, "date" ) == 0 ) {
+		printf ( "%s\n", tstamp ( raw ) );
+		continue;
+	    }
+	    if ( pf && pf->units && strcmp ( pf->units, "semicircles" ) == 0 ) {
+		printf ( "%.6f degrees\n", cc2deg ( raw ) );
+		continue;
+	    }
 
-	data[ndata].time = time;
-	data[ndata].lon = cc2deg(lon);
-	data[ndata].lat = cc2deg(lat);
-	data[ndata].alt = alt;
-	data[ndata].temp = temp;
-	data[ndata].speed = speed;
-	data[ndata].distance = dist;
-	ndata++;
+	    if ( bn == BT_FLOAT32 ) {
+		u32 v32 = raw;
+		memcpy ( &fval, &v32, 4 );
+		val = fval;
+	    } else if ( bn == BT_FLOAT64 ) {
+		memcpy ( &val, &raw, 8 );
+	    } else if ( bt->sign ) {
+		bits = 64 - 8 * fp->size;
+		val = (long) (raw << bits) >> bits;
+	    } else
+		val = raw;
+
+	    if ( pf && pf->scale )
+		val /= pf->scale;
+	    if ( pf )
+		val -= pf->offset;
+
+	    printf ( "%.10g", val );
+	    if ( pf && pf->units )
+		printf ( " %s", pf->units );
+	    printf ( "\n" );
+	}
 }
 
+u32 get_val ( u8 *, int, int );
+
 int
 data_record ( struct definition *dp, int do_decode )
 {
 	int header;
 	int id;
 	// int n;
-	char buf[256];		/* XXX - 128 would do */
+	u8 buf[MSG_MAX];
 
 	header = read1 ();
 	id = header & H_ID;
 
 	/* Don't show all 1175 records */
-	if ( dp->size == 40 ) {
+	if ( dp->gid == GID_RECORD ) {
 	    record_count++;
 	    /* If we don't decode, we still must skip the data */
-	    if ( do_decode )
-		decode ( dp );
-	    else
+	    if ( do_decode && dp->fast ) {
 		readn ( buf, dp->size );
+		dp->fast_decode ( buf );
+		n_fast++;
+	    } else if ( do_decode ) {
+		dp->decode ( dp );
+		n_generic++;
+	    } else {
+		readn ( buf, dp->size );
+		if ( dp->ts_off >= 0 )
+		    last_ts = get_val ( &buf[dp->ts_off], 4, dp->big );
+	    }
 	} else {
-	    if ( dump_level > 1 )
-		printf ( "Data record, header id = %d (%d bytes)\n", id, dp->size  );
 	    readn ( buf, dp->size );
+	    if ( dp->ts_off >= 0 )
+		last_ts = get_val ( &buf[dp->ts_off], 4, dp->big );
+	    if ( dump_level > 1 ) {
+		printf ( "Data record, header id = %d (%d bytes) -- %s\n", id, dp->size,
+		    global_name ( global_lookup ( dp->gid ), dp->gid ) );
+		dump_fields ( dp, buf );
+	    }
 	}
 
 	return 1 + dp->size;
@@ -711,6 +1747,8 @@ record ( void )
 	// int n;
 	int header;
 	int nn;
+	int offset;
+	u32 ts;
 
 	// n = read ( fd, &header, 1 );
 	header = peek1 ();
@@ -719,8 +1757,13 @@ record ( void )
 	// printf ( "Record header: 0x%02x\n", header );
 
 	if ( header & H_COMP ) {
-	    printf ( "Compressed record\n" );
-	    oops ( "Not ready for compressed records" );
+	    /* 2 bits of local ID, 5 bits of time offset */
+	    offset = header & 0x1f;
+	    ts = (last_ts & ~0x1f) + offset;
+	    if ( offset < (last_ts & 0x1f) )
+		ts += 0x20;
+	    last_ts = ts;
+	    nn = data_record ( &defs[(header >> 5) & 0x3], 1 );
 	} else if ( header & H_DEF ) {
 	    if ( dump_level > 1 && record_count )
 		printf ( " %d data records (not shown)\n", record_count );
@@ -730,14 +1773,11 @@ record ( void )
 
 	    /* Usually we see this:
 	     *   Definition record, global ID = 20 -- record (40 bytes)
+	     * Anything else takes the generic path.
 	     */
-	    if ( dhdr.g_id == GID_RECORD && def.size != 40) {
-		printf ( "Definition record, global ID = %d -- %s (%d bytes)\n", dhdr.g_id, gp->name, def.size );
-		oops ( "Data record with unexpected format" );
-	    }
 	} else {
 	    // printf ( "Data record\n" );
-	    nn = data_record ( &def, 1 );
+	    nn = data_record ( &defs[header & H_ID], 1 );
 	}
 
 	// return 1 + nn;
@@ -753,17 +1793,36 @@ header ( void )
 
 	// printf ( "header size expected to be: %d\n", sizeof(struct fit_header) );
 
-	readn ( (u8 *)&hdr, sizeof(struct fit_header) );
+	/* Old files have a 12 byte header with no CRC */
+	readn ( (u8 *)&hdr, 12 );
+	hdr.crc = 0;
 
 	if ( strncmp ( hdr.sig, ".FIT", 4 ) == 0 ) {
 	    if ( dump_level > 1 )
 		printf ( "Signature is OK\n" );
 	} else {
 	    printf ( "Not a FIT file\n" );
+	    if ( oops_jmp )
+		longjmp ( *oops_jmp, 1 );
 	    exit ( 2 );
 	}
 
-	check_header_crc ( (char *) &hdr, hdr.len );
+	if ( hdr.len >= sizeof(struct fit_header) ) {
+	    readn ( (u8 *) &hdr.crc, 2 );
+	    for ( n=sizeof(struct fit_header); n<hdr.len; n++ )
+		(void) read1 ();
+	}
+
+	/* A zero CRC means nobody bothered */
+	if ( hdr.crc )
+	    check_header_crc ( (u8 *) &hdr, sizeof(struct fit_header) );
+
+	/* Get enough arena up front for all the points */
+	if ( data_arena ) {
+	    data_hint = hdr.f_len / HINT_BYTES;
+	    arena_hint ( data_arena, data_hint *
+		(quantize ? sizeof(struct qdata) : sizeof(struct data)) );
+	}
 
 	if ( dump_level > 1 ) {
 	    printf ( "len = %d\n", hdr.len );
@@ -784,46 +1843,83 @@ header ( void )
 }
 
 void
-open_fit ( void )
+open_fit ( char *path )
 {
 	int fd;
 
-	fd = open ( in_path, O_RDONLY );
+	in_reset ();
+	fit_fd = -1;
+
+	if ( in_mem || in_pipe )
+	    return;
+
+	if ( strcmp ( path, "-" ) == 0 ) {
+	    fit_fd = 0;
+	    return;
+	}
+
+	fd = open ( path, O_RDONLY );
 	if ( fd < 0 ) {
-	    printf ( "Input FIT file: %s\n", in_path );
+	    printf ( "Input FIT file: %s\n", path );
 	    oops ( "Cannot open input FIT file" );
 	}
 	fit_fd = fd;
 }
 
+void read_archive ( void );
+void smooth_end ( void );
+
 void
-read_file ( void )
+read_fit ( char *path )
 {
 	int nio;
 	int nrec;
 
-	open_fit ();
-	check_crc ();
+	ndata = 0;
+	record_count = 0;
+	last_ts = 0;
+	n_fast = 0;
+	n_generic = 0;
 
-	nio = header ();
+	open_fit ( path );
 
-	while ( nio > 0 ) {
-	    // printf ( "%d bytes left in file\n", nio );
-	    nrec = record ();
-	    nio -= nrec;
-	}
+	/* FIT files start with the header length, archives with "F66A" */
+	if ( peek1 () == 'F' ) {
+	    read_archive ();
+	} else {
+	    nio = header ();
 
-	if ( nio != 0 ) {
-	    printf ( "%d bytes left in file\n", nio );
-	    oops ( "Buffalo stampede" );
+	    while ( nio > 0 ) {
+		// printf ( "%d bytes left in file\n", nio );
+		nrec = record ();
+		nio -= nrec;
+	    }
+
+	    if ( nio != 0 ) {
+		printf ( "%d bytes left in file\n", nio );
+		oops ( "Buffalo stampede" );
+	    }
+
+	    check_crc ();
 	}
 
-	close ( fit_fd );
+	/* The smoother may be holding on to a few points */
+	smooth_end ();
+
+	if ( fit_fd > 0 )
+	    close ( fit_fd );
+	fit_fd = -1;
 
 	// printf ( "All done\n" );
 	// printf ( "File read successfully: %d data points\n", ndata );
 }
 
+void
+read_file ( void )
+{
+	read_fit ( in_path );
+}
+
 /* -------------------------------------------------------- */
 /* Trim stuff */
 
@@ -865,6 +1961,53 @@ trim_append ( u8 *buf, int n )
 	// printf ( "Trim append %d %d\n", n, ntrim );
 }
 
+/* What a reader of the trimmed file will think the last
+ * timestamp was, and the definitions as they came along
+ * (for rewriting compressed records, see trim_retime).
+ */
+u32 trim_ts;
+u8 trim_def[NLOCAL][DEF_MAX];
+
+/* A compressed timestamp only makes sense after whatever message
+ * came before it.  If we dropped messages in between, the time would
+ * come out wrong, so we send this one with a normal header and its
+ * timestamp as an extra field.  That takes a definition with field
+ * 253 in front, and then the real definition again for the
+ * compressed records after it.
+ */
+void
+trim_retime ( u8 *buf, int nn, int id, u32 ts )
+{
+	static struct field ts_field = { 253, 4, 0x86 };
+	u8 raw[DEF_MAX + 3];
+	u8 *dp = trim_def[id];
+	int nf, dlen;
+	u8 *p;
+
+	nf = dp[5];
+	dlen = 6 + nf * sizeof(struct field);
+	if ( dp[0] & H_HASDEV )
+	    dlen += 1 + dp[dlen] * sizeof(struct field);
+
+	memcpy ( raw, dp, 6 );
+	raw[5] = nf + 1;
+	memcpy ( &raw[6], &ts_field, sizeof(struct field) );
+	memcpy ( &raw[6 + sizeof(struct field)], &dp[6], dlen - 6 );
+	trim_append ( raw, dlen + sizeof(struct field) );
+
+	p = raw;
+	*p++ = id;
+	if ( dp[2] ) {
+	    *p++ = ts >> 24; *p++ = ts >> 16; *p++ = ts >> 8; *p++ = ts;
+	} else {
+	    *p++ = ts; *p++ = ts >> 8; *p++ = ts >> 16; *p++ = ts >> 24;
+	}
+	trim_append ( raw, p - raw );
+	trim_append ( buf + 1, nn - 1 );
+
+	trim_append ( dp, dlen );
+}
+
 /* This is called once for every record in the file.
  * Many of these are not "data records" and should be
  * just copied.  Only data records are considered for
@@ -875,86 +2018,83 @@ trim_record ( int limit )
 {
 	int header;
 	int nn;
-	off_t pos;
-	off_t xpos;
-	u8 buf[256];
+	static u8 buf[MSG_MAX];
+	struct definition *dp;
 	int do_copy;
+	int id, offset;
+	u32 ts;
 
 	header = peek1 ();
 
-	if ( header & H_COMP ) {
-	    printf ( "Compressed record\n" );
-	    oops ( "Not ready for compressed records" );
-	} else if ( header & H_DEF ) {
-	    pos = fit_tell ();
-	    // printf ( "DEFPOS = %d\n", pos );
+	if ( ! (header & H_COMP) && (header & H_DEF) ) {
+	    capture_start ( buf, sizeof(buf) );
 	    nn = definition_record ();
-	    fit_seek ( pos );
-	    readn ( buf, nn );
+	    capture_end ();
 	    trim_append ( buf, nn );
-	    // printf ( "DEF %d\n", nn );
-	    // printf ( "Definition record, global ID = %d -- %s\n", dhdr.g_id, gp->name );
-	    // trim_count = 0;
-	} else {
-	    pos = fit_tell ();
-	    // printf ( "DATAPOS1 = %d\n", pos );
-	    nn = data_record ( &def, 0 );
-	    //xpos = fit_tell ();
-	    //printf ( "DATAPOS2 = %d\n", xpos );
+	    memcpy ( trim_def[header & H_ID], buf, nn );
+	    return nn;
+	}
 
-	    // printf ( "DATA %d bytes (%d)\n", nn, trim_count );
+	/* Keep track of time just like record() does */
+	if ( header & H_COMP ) {
+	    id = (header >> 5) & 0x3;
+	    offset = header & 0x1f;
+	    ts = (last_ts & ~0x1f) + offset;
+	    if ( offset < (last_ts & 0x1f) )
+		ts += 0x20;
+	    last_ts = ts;
+	} else
+	    id = header & H_ID;
+	dp = &defs[id];
+
+	capture_start ( buf, sizeof(buf) );
+	nn = data_record ( dp, 0 );
+	capture_end ();
 
     #ifdef notdef
-	    fit_seek ( pos );
-	    readn ( buf, nn );
-	    hex_dump ( buf, nn );
+	hex_dump ( buf, nn );
     #endif
 
-	    /* Do we copy this record or not?
-	     * If it is not a data record, we copy it.
-	     * We recognize data records by their size of 41 bytes.
-	     *  (this is a bit of a hack XXX )
-	     */
-	    do_copy = 1;
-	    if ( nn == 41 ) {
-		if ( trim_info.state == SKIP ) {
-		    do_copy = 0;
-		    trim_info.skip--;
-		    if ( trim_info.skip == 0 )
-			trim_info.state = COPY;
-		} else if ( trim_info.state == COPY ) {
-		    do_copy = 1;
-		    trim_info.copy--;
-		    if ( trim_info.copy == 0 )
-			trim_info.state = DONE;
-		} else if ( trim_info.state == DONE ) {
-		    do_copy = 0;
-		} else
-		    oops ( "Impossible trim state" );
-	    }
-
-#ifdef notdef
-	    /* XXX - Checking the size is a hackish way to
-	     * identify the records we want.
-	     */
-	    do_copy = 1;
+	/* Do we copy this record or not?
+	 * If it is not a data record, we copy it.
+	 * (This used to go by the size of a 66i record,
+	 *  41 bytes, but the definition tells us.)
+	 */
+	do_copy = 1;
+	if ( dp->gid == GID_RECORD ) {
+	    if ( trim_info.state == SKIP ) {
+		do_copy = 0;
+		trim_info.skip--;
+		if ( trim_info.skip == 0 )
+		    trim_info.state = COPY;
+	    } else if ( trim_info.state == COPY ) {
+		do_copy = 1;
+		trim_info.copy--;
+		if ( trim_info.copy == 0 )
+		    trim_info.state = DONE;
+	    } else if ( trim_info.state == DONE ) {
+		do_copy = 0;
+	    } else
+		oops ( "Impossible trim state" );
+	}
 
-	    trim_count++;
-	    if ( nn == 41 ) {
-		// printf ( "%d %d of %d\n", nn, trim_count, limit );
-		if ( trim_count > limit )
-		    do_copy = 0;
-	    }
-#endif
+	if ( ! do_copy )
+	    return nn;
 
-	    if ( do_copy ) {
-		fit_seek ( pos );
-		// printf ( "Copy %d bytes\n", nn );
-		readn ( buf, nn );
+	if ( header & H_COMP ) {
+	    /* What a reader of our output would make of it */
+	    ts = (trim_ts & ~0x1f) + offset;
+	    if ( offset < (trim_ts & 0x1f) )
+		ts += 0x20;
+	    if ( ts != last_ts )
+		trim_retime ( buf, nn, id, last_ts );
+	    else
 		trim_append ( buf, nn );
-	    }
-	    // xpos = fit_tell ();
-	    // printf ( "DATAPOS3 = %d\n", xpos );
+	    trim_ts = last_ts;
+	} else {
+	    trim_append ( buf, nn );
+	    if ( dp->ts_off >= 0 )
+		trim_ts = last_ts;
 	}
 
 	return nn;
@@ -967,7 +2107,8 @@ int trim_fd;
 void
 trim_file ( int start, int end )
 {
-	struct fit_header hdr;
+	u8 hbuf[255];
+	int hlen;
 	int nio;
 	int nrec;
 	int fd;
@@ -983,12 +2124,13 @@ trim_file ( int start, int end )
 	else
 	    trim_info.state = COPY;
 
-	open_fit ();
+	open_fit ( in_path );
 
-	/* Read and copy header */
-	readn ( (u8 *)&hdr, sizeof(struct fit_header) );
-	trim_append ( (u8 *) &hdr, sizeof(struct fit_header) );
-	nio = hdr.f_len;
+	/* Read and copy header, whatever length it is */
+	capture_start ( hbuf, sizeof(hbuf) );
+	nio = header ();
+	hlen = capture_end ();
+	trim_append ( hbuf, hlen );
 
 	// printf ( "Trim: %d data bytes expected\n", nio );
 
@@ -1003,8 +2145,11 @@ trim_file ( int start, int end )
 	    oops ( "Buffalo stampede (trim)" );
 	}
 
+	check_crc ();
+
 	/* Put proper data length into header */
-	hdr.f_len = ntrim - sizeof(struct fit_header);
+	hdr.f_len = ntrim - hlen;
+	memcpy ( trim_buf, (u8 *) &hdr, 12 );
 
 	/* Recalculate CRC values.
 	 * Amazingly, the way this works is that you have something
@@ -1015,11 +2160,12 @@ trim_file ( int start, int end )
 	 * zero.
 	 */
 
-	/* Header CRC */
+	/* Header CRC (old 12 byte headers don't have one) */
 	// printf ( "Buffer CRC = %02x %02x\n", trim_buf[12], trim_buf[13] );
-	crc = calc_crc ( (u8 *) &hdr, sizeof(struct fit_header)-2 );
-	hdr.crc = crc;
-	memcpy ( trim_buf, (u8 *) &hdr, sizeof(struct fit_header) );
+	if ( hlen >= sizeof(struct fit_header) ) {
+	    crc = calc_crc ( trim_buf, 12 );
+	    memcpy ( &trim_buf[12], (u8 *) &crc, 2 );
+	}
 	// printf ( "Buffer CRC = %02x %02x\n", trim_buf[12], trim_buf[13] );
 
 	/* File CRC */
@@ -1041,75 +2187,5251 @@ trim_file ( int start, int end )
 	close ( fit_fd );
 }
 
-void
-dump_file ( void )
-{
-	dump_level = 2;
-	// printf ( "dump file, dump level = %d\n", dump_level );
-	read_file ();
-}
+/* -------------------------------------------------------- */
+/* Whole files in memory.
+ *
+ * The routines up above read a file a piece at a time and only
+ * keep the most recent definition.  That is fine for the 66i,
+ * where every definition is followed by its data, but merging
+ * files means walking several of them side by side.
+ * So here a "cursor" walks a file that has been read into memory,
+ * keeping track of all 16 local definitions as it goes.
+ *
+ * A cursor can also stream (see cursor_stream), looking at the file
+ * through a window of CUR_BUF bytes that slides along as it goes.
+ * Then the definitions get copied, since the window moves out from
+ * under them, and the CRC gets checked at the end.  This is how
+ * merge reads, so a year of tracks doesn't have to fit in memory.
+ */
 
-int rec_num = -1;
+#define CUR_BUF		(256*1024)
 
-void
-out_cmd ( int n )
-{
-	struct data *dp;
+#define TS_FIELD	253
 
-	dp = &data[n];
-	printf ( "MC %.6f %.6f\n", dp->lon, dp->lat );
-}
+struct ldef {
+	int valid;
+	int big;		/* big endian */
+	int gid;
+	int size;		/* bytes in a data message (less header) */
+	int ts_off;		/* offset of field 253, or -1 */
+	u8 *raw;		/* the definition message, header and all */
+	int dlen;
+	u8 copy[DEF_MAX];	/* raw points here when streaming */
+};
 
-void
-show_data ( void )
-{
-	int i;
-	struct data *dp;
+struct cursor {
+	u8 *buf;
+	int len;
+	int pos;
+	int end;		/* end of the records */
+	struct fit_header hdr;
+	struct ldef ldef[NLOCAL];
+	u32 last_ts;
 
-	for ( i=0; i<ndata; i++ ) {
-	    dp = &data[i];
-	    printf ( "%s %.6f %.6f %.2f %.1f %.1f %.1f\n",
-		tstamp(dp->time), dp->lon, dp->lat, dp->alt, dp->temp, dp->speed, dp->distance );
-	}
-}
+	/* The data message we are sitting on */
+	u8 *msg;		/* points at its header byte */
+	struct ldef *dp;
+	int comp;		/* had a compressed timestamp header */
+	u32 ts;			/* its own timestamp, or the last one seen */
 
-/* --------------------------------------------------------- */
-/* --------------------------------------------------------- */
+	/* Streaming, buf is a window on the file */
+	int stream;
+	int fd;
+	long nread;		/* bytes of the file read so far */
+	long flen;		/* bytes under the CRC, and the CRC */
+	u16 crc;
+};
 
-/* Actual usage:
- * fit66 path is the same as fit66 -e path
- * fit66 -e path - extracts records as ascii
- * fit66 -d path - dumps the file for analysis
- * fit66 -t path - trims the file (not quite done)
- *   (see NTRIM below)
+/* Read a whole file, "-" being stdin.
+ * We go until end of file rather than trusting the size,
+ * so pipes work too.
  */
+u16 par_crc ( u8 *, long );
 
-enum cmd { EXTRACT, DUMP, TRIM };
+u8 *
+load_file ( char *path, int *len )
+{
+	struct stat st;
+	u8 *buf;
+	int fd;
+	int n, nn;
+	int max;
 
-enum cmd cmd = EXTRACT;
+	if ( strcmp ( path, "-" ) == 0 )
+	    fd = 0;
+	else
+	    fd = open ( path, O_RDONLY );
+	if ( fd < 0 ) {
+	    printf ( "Input FIT file: %s\n", path );
+	    oops ( "Cannot open input FIT file" );
+	}
 
-char *limits;
+	max = 65536;
+	if ( fstat ( fd, &st ) == 0 && S_ISREG ( st.st_mode ) )
+	    max = st.st_size + 1;
 
-void
-usage ( void )
+	buf = malloc ( max );
+	if ( ! buf )
+	    oops ( "Out of memory for input file" );
+
+	for ( n = 0; ; n += nn ) {
+	    if ( n == max ) {
+		max *= 2;
+		buf = realloc ( buf, max );
+		if ( ! buf )
+		    oops ( "Out of memory for input file" );
+	    }
+	    nn = read ( fd, &buf[n], max - n );
+	    if ( nn < 0 )
+		oops ( "Read error on input FIT file" );
+	    if ( nn == 0 )
+		break;
+	}
+	if ( fd > 0 )
+	    close ( fd );
+
+	*len = n;
+	return buf;
+}
+
+u32
+get_val ( u8 *p, int size, int big )
 {
-	oops ( "Usage: fit66 -e path" );
+	u32 val = 0;
+	int i;
+
+	if ( big )
+	    for ( i=0; i<size; i++ )
+		val = (val << 8) | p[i];
+	else
+	    for ( i=size-1; i>=0; i-- )
+		val = (val << 8) | p[i];
+	return val;
 }
 
 void
-usage_t ( void )
+cursor_open ( struct cursor *cp, u8 *buf, int len )
 {
-	oops ( "Usage: fit66 -t sstart:end inpath outpath" );
+	memset ( cp, 0, sizeof(struct cursor) );
+	cp->buf = buf;
+	cp->len = len;
+
+	if ( len < 12 )
+	    oops ( "Not a FIT file" );
+	memcpy ( &cp->hdr, buf, len < sizeof(struct fit_header) ? 12 : sizeof(struct fit_header) );
+	if ( strncmp ( cp->hdr.sig, ".FIT", 4 ) != 0 )
+	    oops ( "Not a FIT file" );
+	if ( cp->hdr.len < 12 || cp->hdr.len + cp->hdr.f_len + 2 > len )
+	    oops ( "FIT file is truncated" );
+
+	/* Old style 12 byte headers have no CRC,
+	 * and a zero CRC means it was not filled in.
+	 */
+	if ( cp->hdr.len >= 14 && cp->hdr.crc && calc_crc ( buf, 14 ) )
+	    oops ( "Bad header CRC" );
+	if ( par_crc ( buf, cp->hdr.len + cp->hdr.f_len + 2 ) )
+	    oops ( "Bad file CRC" );
+
+	cp->pos = cp->hdr.len;
+	cp->end = cp->hdr.len + cp->hdr.f_len;
 }
 
+/* Make sure the window has n bytes past pos (or the rest of the
+ * file, if that is less).  The window gets slid down so pos is at
+ * the front, and then filled up.  pos and end move with it.
+ */
 void
-cmdline ( int argc, char **argv )
+cursor_fill ( struct cursor *cp, int n )
 {
-	char *p;
+	int nn, ncrc;
 
-	while ( argc ) {
-	    p = *argv;
-	    if ( *p != '-' )
+	if ( ! cp->stream || cp->len - cp->pos >= n )
+	    return;
+
+	memmove ( cp->buf, &cp->buf[cp->pos], cp->len - cp->pos );
+	cp->len -= cp->pos;
+	cp->end -= cp->pos;
+	cp->pos = 0;
+
+	while ( cp->len < n ) {
+	    nn = read ( cp->fd, &cp->buf[cp->len], CUR_BUF - cp->len );
+	    if ( nn < 0 )
+		oops ( "Read error on input FIT file" );
+	    if ( nn == 0 )
+		break;
+
+	    /* Anything after the file CRC isn't under it */
+	    ncrc = nn;
+	    if ( cp->nread + ncrc > cp->flen )
+		ncrc = cp->flen - cp->nread;
+	    if ( ncrc > 0 )
+		cp->crc = crc_block ( cp->crc, &cp->buf[cp->len], ncrc );
+
+	    cp->nread += nn;
+	    cp->len += nn;
+	}
+
+	if ( cp->len < n )
+	    oops ( "FIT file is truncated" );
+}
+
+/* Open a cursor that reads the file as it goes, "-" being stdin */
+void
+cursor_stream ( struct cursor *cp, char *path )
+{
+	memset ( cp, 0, sizeof(struct cursor) );
+	cp->stream = 1;
+
+	if ( strcmp ( path, "-" ) == 0 )
+	    cp->fd = 0;
+	else
+	    cp->fd = open ( path, O_RDONLY );
+	if ( cp->fd < 0 ) {
+	    printf ( "Input FIT file: %s\n", path );
+	    oops ( "Cannot open input FIT file" );
+	}
+
+	cp->buf = malloc ( CUR_BUF );
+	if ( ! cp->buf )
+	    oops ( "Out of memory for input file" );
+
+	/* Enough to get the header, which says how long the rest is */
+	cp->flen = sizeof(struct fit_header);
+	cursor_fill ( cp, 12 );
+	memcpy ( &cp->hdr, cp->buf, cp->len < sizeof(struct fit_header) ? 12 : sizeof(struct fit_header) );
+	if ( strncmp ( cp->hdr.sig, ".FIT", 4 ) != 0 )
+	    oops ( "Not a FIT file" );
+	if ( cp->hdr.len < 12 )
+	    oops ( "FIT file is truncated" );
+	if ( cp->hdr.len >= 14 && cp->hdr.crc && calc_crc ( cp->buf, 14 ) )
+	    oops ( "Bad header CRC" );
+
+	/* Now we know, and the CRC can catch up */
+	cp->flen = (long) cp->hdr.len + cp->hdr.f_len + 2;
+	cp->crc = crc_block ( 0, cp->buf, cp->len < cp->flen ? cp->len : cp->flen );
+
+	cp->pos = cp->hdr.len;
+	cp->end = cp->hdr.len + cp->hdr.f_len;
+}
+
+void
+cursor_close ( struct cursor *cp )
+{
+	if ( cp->stream && cp->fd > 0 )
+	    close ( cp->fd );
+	free ( cp->buf );
+	cp->buf = NULL;
+}
+
+void
+cursor_def ( struct cursor *cp )
+{
+	u8 *p = &cp->buf[cp->pos];
+	struct ldef *dp;
+	int nf, nd;
+	int off;
+	int i;
+
+	if ( cp->pos + 6 > cp->end )
+	    oops ( "Definition runs off the end" );
+
+	dp = &cp->ldef[p[0] & H_ID];
+	dp->big = p[2];
+	dp->gid = get_val ( &p[3], 2, dp->big );
+	nf = p[5];
+	dp->dlen = 6 + nf * 3;
+	if ( p[0] & H_HASDEV ) {
+	    if ( cp->pos + dp->dlen + 1 > cp->end )
+		oops ( "Definition runs off the end" );
+	    nd = p[dp->dlen];
+	    dp->dlen += 1 + nd * 3;
+	}
+	if ( cp->pos + dp->dlen > cp->end )
+	    oops ( "Definition runs off the end" );
+
+	dp->size = 0;
+	dp->ts_off = -1;
+	for ( i=0; i<nf; i++ ) {
+	    off = 6 + i * 3;
+	    if ( p[off] == TS_FIELD && p[off+1] == 4 )
+		dp->ts_off = dp->size;
+	    dp->size += p[off+1];
+	}
+	if ( p[0] & H_HASDEV )
+	    for ( i=0; i<nd; i++ )
+		dp->size += p[6 + nf*3 + 1 + i*3 + 1];
+
+	dp->raw = p;
+	if ( cp->stream ) {
+	    memcpy ( dp->copy, p, dp->dlen );
+	    dp->raw = dp->copy;
+	}
+	dp->valid = 1;
+	cp->pos += dp->dlen;
+}
+
+/* Step to the next data message, soaking up definitions on the way.
+ * Returns 0 at the end of the file.
+ */
+int
+cursor_next ( struct cursor *cp )
+{
+	u8 *p;
+	int offset;
+
+	while ( cp->pos < cp->end ) {
+	    cursor_fill ( cp, cp->end - cp->pos < MSG_MAX ? cp->end - cp->pos : MSG_MAX );
+	    p = &cp->buf[cp->pos];
+
+	    if ( ! (p[0] & H_COMP) && (p[0] & H_DEF) ) {
+		cursor_def ( cp );
+		continue;
+	    }
+
+	    cp->msg = p;
+	    cp->comp = p[0] & H_COMP;
+
+	    if ( cp->comp ) {
+		/* 2 bits of local ID, 5 bits of time offset */
+		cp->dp = &cp->ldef[(p[0] >> 5) & 0x3];
+		offset = p[0] & 0x1f;
+		cp->ts = (cp->last_ts & ~0x1f) + offset;
+		if ( offset < (cp->last_ts & 0x1f) )
+		    cp->ts += 0x20;
+		cp->last_ts = cp->ts;
+	    } else {
+		cp->dp = &cp->ldef[p[0] & H_ID];
+	    }
+
+	    if ( ! cp->dp->valid )
+		oops ( "Data message with no definition" );
+	    if ( cp->pos + 1 + cp->dp->size > cp->end )
+		oops ( "Data message runs off the end" );
+
+	    if ( ! cp->comp ) {
+		if ( cp->dp->ts_off >= 0 )
+		    cp->last_ts = get_val ( &p[1 + cp->dp->ts_off], 4, cp->dp->big );
+		cp->ts = cp->last_ts;
+	    }
+
+	    cp->pos += 1 + cp->dp->size;
+	    return 1;
+	}
+
+	if ( cp->pos != cp->end )
+	    oops ( "Buffalo stampede (cursor)" );
+
+	/* Pull in the file CRC, and it all should come out zero */
+	if ( cp->stream ) {
+	    cursor_fill ( cp, 2 );
+	    if ( cp->crc )
+		oops ( "Bad file CRC" );
+	}
+	return 0;
+}
+
+/* -------------------------------------------------------- */
+/* Writing FIT files a message at a time.
+ *
+ * Output goes through a buffer and the CRC is kept up to date
+ * as we go, so nothing gets read back.  The catch is that the
+ * file CRC covers the header, and we don't know what goes in the
+ * header (f_len) until the end.  But this CRC is linear, so
+ *
+ *   crc ( header + data ) = crc ( header + zeros ) ^ crc ( data )
+ *
+ * and we can do the header part last (see crc_combine).
+ *
+ * Output local IDs have nothing to do with the input ones.
+ * We remember what definition is in each of our 16 slots and
+ * only send a new definition when a message needs one that
+ * is not already there.
+ */
+
+#define OUT_BUF		65536
+
+struct fit_out {
+	char *path;
+	int fd;
+	u8 buf[OUT_BUF];
+	int nbuf;
+	u32 nbytes;		/* data bytes so far */
+	u16 crc;		/* CRC of those bytes */
+	u8 slot[NLOCAL][DEF_MAX];
+	int slot_len[NLOCAL];
+	int slot_lo;		/* ordinary messages use slot_lo and up */
+	int next_slot;
+	int next_comp;
+	int nmsg;
+};
+
+/* Compressed timestamp headers only have room for local IDs 0-3 */
+#define NCOMP		4
+
+void
+out_flush ( struct fit_out *op )
+{
+	int n = 0;
+	int nn;
+
+	while ( n < op->nbuf ) {
+	    nn = write ( op->fd, &op->buf[n], op->nbuf - n );
+	    if ( nn <= 0 )
+		oops ( "Write error on output FIT file" );
+	    n += nn;
+	}
+	op->nbuf = 0;
+}
+
+void
+out_bytes ( struct fit_out *op, u8 *p, int n )
+{
+	int i;
+
+	for ( i=0; i<n; i++ )
+	    op->crc = fit_crc16 ( p[i], op->crc );
+	op->nbytes += n;
+
+	while ( n > 0 ) {
+	    if ( op->nbuf == OUT_BUF )
+		out_flush ( op );
+	    i = OUT_BUF - op->nbuf;
+	    if ( i > n )
+		i = n;
+	    memcpy ( &op->buf[op->nbuf], p, i );
+	    op->nbuf += i;
+	    p += i;
+	    n -= i;
+	}
+}
+
+struct fit_out *
+out_open ( char *path )
+{
+	struct fit_out *op;
+
+	op = calloc ( 1, sizeof(struct fit_out) );
+	if ( ! op )
+	    oops ( "Out of memory for output" );
+	op->path = path;
+
+	op->fd = open ( path, O_CREAT | O_WRONLY | O_TRUNC, 0644 );
+	if ( op->fd < 0 ) {
+	    printf ( "Output FIT file: %s\n", path );
+	    oops ( "Cannot open output FIT file" );
+	}
+
+	/* Leave room for the header */
+	if ( lseek ( op->fd, sizeof(struct fit_header), SEEK_SET ) < 0 )
+	    oops ( "Cannot seek output FIT file" );
+	return op;
+}
+
+/* Get a local ID (from lo up to hi) holding this definition,
+ * sending it if need be.
+ * Slots get reused round robin, which is plenty for
+ * files that have one active definition at a time.
+ */
+int
+out_def ( struct fit_out *op, u8 *raw, int dlen, int lo, int hi, int *next )
+{
+	int i;
+
+	for ( i=lo; i<hi; i++ ) {
+	    if ( op->slot_len[i] == dlen &&
+		    (op->slot[i][0] & H_HASDEV) == (raw[0] & H_HASDEV) &&
+		    memcmp ( &op->slot[i][1], &raw[1], dlen-1 ) == 0 )
+		return i;
+	}
+
+	i = lo + *next;
+	*next = (*next + 1) % (hi - lo);
+
+	memcpy ( op->slot[i], raw, dlen );
+	op->slot[i][0] = H_DEF | (raw[0] & H_HASDEV) | i;
+	op->slot_len[i] = dlen;
+	out_bytes ( op, op->slot[i], dlen );
+
+	return i;
+}
+
+/* Send a data message (the body, without header) using this definition */
+void
+out_data ( struct fit_out *op, u8 *raw, int dlen, u8 *body, int size )
+{
+	u8 h;
+
+	h = out_def ( op, raw, dlen, op->slot_lo, NLOCAL, &op->next_slot );
+	out_bytes ( op, &h, 1 );
+	out_bytes ( op, body, size );
+	op->nmsg++;
+}
+
+/* The same, but with a compressed timestamp header.
+ * The definition must not have a timestamp field.
+ */
+void
+out_comp ( struct fit_out *op, u8 *raw, int dlen, u8 *body, int size, u32 ts )
+{
+	u8 h;
+
+	h = out_def ( op, raw, dlen, 0, NCOMP, &op->next_comp );
+	h = H_COMP | (h << 5) | (ts & 0x1f);
+	out_bytes ( op, &h, 1 );
+	out_bytes ( op, body, size );
+	op->nmsg++;
+}
+
+/* Send the message the cursor is sitting on.
+ * A message that came with a compressed timestamp header has
+ * no timestamp field, and the time would get lost if we just
+ * gave it an ordinary header, so we give it a definition with
+ * field 253 put on the front.
+ */
+void
+out_message ( struct fit_out *op, struct cursor *cp )
+{
+	struct ldef *dp = cp->dp;
+	u8 xraw[DEF_MAX + 3];
+	u8 body[4 + MSG_MAX];
+	int i;
+
+	if ( ! cp->comp ) {
+	    out_data ( op, dp->raw, dp->dlen, &cp->msg[1], dp->size );
+	    return;
+	}
+
+	if ( dp->raw[5] == 255 )
+	    oops ( "No room for a timestamp field" );
+
+	memcpy ( xraw, dp->raw, 5 );
+	xraw[5] = dp->raw[5] + 1;
+	xraw[6] = TS_FIELD;
+	xraw[7] = 4;
+	xraw[8] = 0x86;		/* uint32 */
+	memcpy ( &xraw[9], &dp->raw[6], dp->dlen - 6 );
+
+	for ( i=0; i<4; i++ )
+	    body[dp->big ? 3-i : i] = cp->ts >> (8*i);
+	memcpy ( &body[4], &cp->msg[1], dp->size );
+
+	out_data ( op, xraw, dp->dlen + 3, body, 4 + dp->size );
+}
+
+/* Put the header on the front and the CRC on the back.
+ * proto gives us the protocol and profile versions.
+ */
+void
+out_close ( struct fit_out *op, struct fit_header *proto )
+{
+	struct fit_header hdr;
+	u16 crc;
+
+	out_flush ( op );
+
+	hdr.len = sizeof(struct fit_header);
+	hdr.prot_ver = proto->prot_ver;
+	hdr.prof_ver = proto->prof_ver;
+	hdr.f_len = op->nbytes;
+	memcpy ( hdr.sig, ".FIT", 4 );
+	hdr.crc = calc_crc ( (u8 *) &hdr, sizeof(struct fit_header)-2 );
+
+	crc = crc_combine ( calc_crc ( (u8 *) &hdr, sizeof(struct fit_header) ), op->crc, op->nbytes );
+
+	if ( write ( op->fd, &crc, 2 ) != 2 )
+	    oops ( "Write error on output FIT file" );
+	if ( pwrite ( op->fd, &hdr, sizeof(struct fit_header), 0 ) != sizeof(struct fit_header) )
+	    oops ( "Write error on output FIT file" );
+
+	close ( op->fd );
+	free ( op );
+}
+
+/* -------------------------------------------------------- */
+/* Merge stuff --
+ *
+ * A trip of several days ends up as one FIT file per day.
+ * fit66 -M out.fit in1.fit in2.fit ... makes them one file.
+ *
+ * This is a k-way merge on timestamp.  Each input has a streaming
+ * cursor (so just CUR_BUF of it is in memory at a time) and the
+ * cursors sit in a little heap ordered by the time of the
+ * message each one is on.  Only record messages go by their own
+ * timestamp.  Everything else goes with the last record time seen
+ * in its file, so it stays put relative to the records around it.
+ * (The device info message has a timestamp from the end of the
+ * activity, even though it comes before all the records.)
+ *
+ * We keep the file ID and file creator from the first file
+ * and the activity message from the last one.  Everything else
+ * (records, events, laps, sessions) gets merged.
+ */
+
+#define GID_FILE_ID	0
+#define GID_CREATOR	49
+#define GID_ACTIVITY	34
+
+struct cursor *merge_cur;
+u32 *merge_key;
+int *merge_heap;
+int merge_nheap;
+
+int
+merge_less ( int a, int b )
+{
+	if ( merge_key[a] != merge_key[b] )
+	    return merge_key[a] < merge_key[b];
+	return a < b;
+}
+
+/* Step input i along and work out its new key */
+int
+merge_next ( int i )
+{
+	struct cursor *cp = &merge_cur[i];
+
+	if ( ! cursor_next ( cp ) )
+	    return 0;
+	if ( cp->dp->gid == GID_RECORD )
+	    merge_key[i] = cp->ts;
+	return 1;
+}
+
+void
+merge_down ( int i )
+{
+	int kid, tmp;
+
+	for ( ;; ) {
+	    kid = 2*i + 1;
+	    if ( kid >= merge_nheap )
+		break;
+	    if ( kid + 1 < merge_nheap && merge_less ( merge_heap[kid+1], merge_heap[kid] ) )
+		kid++;
+	    if ( ! merge_less ( merge_heap[kid], merge_heap[i] ) )
+		break;
+	    tmp = merge_heap[i];
+	    merge_heap[i] = merge_heap[kid];
+	    merge_heap[kid] = tmp;
+	    i = kid;
+	}
+}
+
+void check_file ( char * );
+
+void
+merge_files ( char *out, char **paths, int n )
+{
+	struct fit_out *op;
+	struct cursor *cp;
+	int nrec = 0;
+	int keep;
+	int len;
+	int i;
+
+	merge_cur = calloc ( n, sizeof(struct cursor) );
+	merge_key = calloc ( n, sizeof(u32) );
+	merge_heap = calloc ( n, sizeof(int) );
+	if ( ! merge_cur || ! merge_key || ! merge_heap )
+	    oops ( "Out of memory for merge" );
+
+	/* Catch bad files before any output gets written.
+	 * Pipes only get checked when we get to their end.
+	 */
+	for ( i=0; i<n; i++ )
+	    check_file ( paths[i] );
+
+	merge_nheap = 0;
+	for ( i=0; i<n; i++ ) {
+	    cp = &merge_cur[i];
+	    cursor_stream ( cp, paths[i] );
+	    if ( merge_next ( i ) )
+		merge_heap[merge_nheap++] = i;
+	}
+	for ( i=merge_nheap/2 - 1; i>=0; i-- )
+	    merge_down ( i );
+
+	op = out_open ( out );
+
+	while ( merge_nheap ) {
+	    i = merge_heap[0];
+	    cp = &merge_cur[i];
+
+	    keep = 1;
+	    if ( cp->dp->gid == GID_FILE_ID || cp->dp->gid == GID_CREATOR )
+		keep = i == 0;
+	    if ( cp->dp->gid == GID_ACTIVITY )
+		keep = i == n - 1;
+
+	    if ( keep ) {
+		out_message ( op, cp );
+		if ( cp->dp->gid == GID_RECORD )
+		    nrec++;
+	    }
+
+	    if ( ! merge_next ( i ) )
+		merge_heap[0] = merge_heap[--merge_nheap];
+	    merge_down ( 0 );
+	}
+
+	i = op->nmsg;
+	len = op->nbytes;
+	out_close ( op, &merge_cur[0].hdr );
+
+	printf ( "Merged %d files: %d messages, %d records, %d bytes\n",
+	    n, i, nrec, len + (int) sizeof(struct fit_header) + 2 );
+
+	for ( i=0; i<n; i++ )
+	    cursor_close ( &merge_cur[i] );
+	free ( merge_cur );
+	free ( merge_key );
+	free ( merge_heap );
+}
+
+/* -------------------------------------------------------- */
+/* Re-encoding --
+ *
+ * fit66 -z in.fit out.fit writes the same messages back out,
+ * only smaller:
+ *
+ *  - A field that has the invalid value in every message using
+ *    some definition gets left out of that definition.
+ *    On the 66i that is heart rate, cadence, the 16 bit altitude
+ *    and speed, and a few more (see the list above decode()).
+ *  - A message whose time is within 31 seconds of the last
+ *    timestamp gets a compressed timestamp header instead of
+ *    a timestamp field.  That is nearly every record.
+ *
+ * A field that is missing means the same thing in FIT as a field
+ * with the invalid value, so nothing is lost.
+ *
+ * This takes two passes over the file in memory, the first to
+ * find out which fields ever have a valid value.
+ */
+
+struct zdef {
+	u8 *raw;		/* the first definition like this one */
+	int dlen;
+	u8 valid[255];		/* field i was valid somewhere */
+};
+
+#define ZDEF_MAX	256
+
+struct zdef *zdefs;
+int nzdef;
+
+/* Is this field the invalid value (every element of it, for arrays) */
+int
+field_invalid ( u8 *p, int size, int type, int big )
+{
+	struct base_type *bt;
+	unsigned long raw;
+	int bn;
+	int i, j;
+
+	bn = type & 0x1f;
+	if ( bn >= NBASE )
+	    return 0;
+	bt = &base_types[bn];
+	if ( size % bt->size )
+	    return 0;
+
+	for ( i=0; i<size; i += bt->size ) {
+	    raw = 0;
+	    for ( j=0; j<bt->size; j++ )
+		raw |= (unsigned long) p[i+j] << 8 * (big ? bt->size-1-j : j);
+	    if ( raw != bt->invalid )
+		return 0;
+	}
+	return 1;
+}
+
+/* Same definition as one we have already, other than local ID? */
+int
+zdef_find ( u8 *raw, int dlen )
+{
+	struct zdef *zp;
+	int i;
+
+	for ( i=0; i<nzdef; i++ ) {
+	    zp = &zdefs[i];
+	    if ( zp->dlen == dlen &&
+		    (zp->raw[0] & H_HASDEV) == (raw[0] & H_HASDEV) &&
+		    memcmp ( &zp->raw[1], &raw[1], dlen-1 ) == 0 )
+		return i;
+	}
+
+	if ( nzdef >= ZDEF_MAX )
+	    oops ( "Too many different definitions" );
+	zp = &zdefs[nzdef];
+	memset ( zp, 0, sizeof(struct zdef) );
+	zp->raw = raw;
+	zp->dlen = dlen;
+	return nzdef++;
+}
+
+/* Which zdef goes with the message the cursor is on.
+ * The cache saves comparing definitions for every message.
+ */
+int
+zdef_of ( struct cursor *cp, u8 **cache_raw, int *cache_z )
+{
+	int local = cp->dp - cp->ldef;
+
+	if ( cache_raw[local] != cp->dp->raw ) {
+	    cache_raw[local] = cp->dp->raw;
+	    cache_z[local] = zdef_find ( cp->dp->raw, cp->dp->dlen );
+	}
+	return cache_z[local];
+}
+
+void
+reencode ( char *in, char *out )
+{
+	struct cursor cur, *cp = &cur;
+	struct fit_out *op;
+	struct zdef *zp;
+	struct ldef *dp;
+	u8 *cache_raw[NLOCAL];
+	int cache_z[NLOCAL];
+	u8 xraw[DEF_MAX];
+	u8 body[4 + MSG_MAX];
+	u8 *raw, *msg;
+	int xlen, blen;
+	int nf, nd, nkeep;
+	int moff;
+	int comp, has_time;
+	int ncomp = 0;
+	u32 last = 0;
+	u32 t;
+	u8 *buf;
+	int len;
+	int i;
+
+	buf = load_file ( in, &len );
+	zdefs = calloc ( ZDEF_MAX, sizeof(struct zdef) );
+	if ( ! zdefs )
+	    oops ( "Out of memory for definitions" );
+	nzdef = 0;
+
+	/* Pass 1 - which fields are ever valid */
+	memset ( cache_raw, 0, sizeof(cache_raw) );
+	cursor_open ( cp, buf, len );
+	while ( cursor_next ( cp ) ) {
+	    dp = cp->dp;
+	    zp = &zdefs[zdef_of ( cp, cache_raw, cache_z )];
+	    raw = dp->raw;
+	    moff = 1;
+	    for ( i=0; i<raw[5]; i++ ) {
+		if ( ! zp->valid[i] &&
+			! field_invalid ( &cp->msg[moff], raw[6+i*3+1], raw[6+i*3+2], dp->big ) )
+		    zp->valid[i] = 1;
+		moff += raw[6+i*3+1];
+	    }
+	}
+
+	/* Pass 2 - write it out.
+	 * Ordinary messages keep out of the slots that
+	 * compressed headers need.
+	 */
+	op = out_open ( out );
+	op->slot_lo = NCOMP;
+
+	memset ( cache_raw, 0, sizeof(cache_raw) );
+	cursor_open ( cp, buf, len );
+	while ( cursor_next ( cp ) ) {
+	    dp = cp->dp;
+	    zp = &zdefs[zdef_of ( cp, cache_raw, cache_z )];
+	    raw = dp->raw;
+	    msg = cp->msg;
+	    nf = raw[5];
+
+	    /* The reader works out compressed times from the last
+	     * timestamp it saw, so we keep track the same way.
+	     */
+	    has_time = cp->comp || dp->ts_off >= 0;
+	    t = cp->ts;
+	    comp = has_time && t >= last && t - last < 32;
+
+	    memcpy ( xraw, raw, 5 );
+	    xraw[0] = H_DEF | (raw[0] & H_HASDEV);
+	    xlen = 6;
+	    blen = 0;
+	    nkeep = 0;
+
+	    if ( has_time && ! comp ) {
+		xraw[xlen++] = TS_FIELD;
+		xraw[xlen++] = 4;
+		xraw[xlen++] = 0x86;	/* uint32 */
+		for ( i=0; i<4; i++ )
+		    body[blen + (dp->big ? 3-i : i)] = t >> (8*i);
+		blen += 4;
+		nkeep++;
+	    }
+
+	    moff = 1;
+	    for ( i=0; i<nf; i++ ) {
+		u8 *fp = &raw[6+i*3];
+
+		if ( zp->valid[i] && ! (fp[0] == TS_FIELD && fp[1] == 4) ) {
+		    memcpy ( &xraw[xlen], fp, 3 );
+		    xlen += 3;
+		    memcpy ( &body[blen], &msg[moff], fp[1] );
+		    blen += fp[1];
+		    nkeep++;
+		}
+		moff += fp[1];
+	    }
+	    xraw[5] = nkeep;
+
+	    /* Developer fields go along as they are */
+	    if ( raw[0] & H_HASDEV ) {
+		nd = raw[6 + nf*3];
+		memcpy ( &xraw[xlen], &raw[6 + nf*3], 1 + nd*3 );
+		xlen += 1 + nd*3;
+		memcpy ( &body[blen], &msg[moff], 1 + dp->size - moff );
+		blen += 1 + dp->size - moff;
+	    }
+
+	    if ( comp ) {
+		out_comp ( op, xraw, xlen, body, blen, t );
+		ncomp++;
+	    } else
+		out_data ( op, xraw, xlen, body, blen );
+
+	    if ( has_time )
+		last = t;
+	}
+
+	i = op->nmsg;
+	blen = op->nbytes + sizeof(struct fit_header) + 2;
+	out_close ( op, &cp->hdr );
+
+	printf ( "Re-encoded %d messages (%d with compressed timestamps): %d bytes, was %d\n",
+	    i, ncomp, blen, len );
+
+	free ( zdefs );
+	free ( buf );
+}
+
+void
+dump_file ( void )
+{
+	dump_level = 2;
+	// printf ( "dump file, dump level = %d\n", dump_level );
+	read_file ();
+	printf ( "Records decoded: %d fast path, %d generic\n", n_fast, n_generic );
+}
+
+int rec_num = -1;
+
+void
+out_cmd ( int n )
+{
+	struct data pt, *dp;
+
+	dp = get_point ( n, &pt );
+	printf ( "MC %.6f %.6f\n", dp->lon, dp->lat );
+}
+
+/* --------------------------------------------------------- */
+/* Smoothing --
+ *
+ * The barometric altitude from the 66i wanders around by a few
+ * feet all the time, even sitting on a table.  Add up every
+ * little wiggle and you "climb" thousands of feet doing nothing.
+ *
+ * So altitude gets smoothed in two steps:
+ *  - a moving median over sm_window points, which gets rid of
+ *    spikes without rounding off real corners the way a mean would.
+ *  - hysteresis: climbing or descending only counts once the
+ *    smoothed altitude gets sm_thresh feet away from where it
+ *    was last counted from.
+ *
+ * This is a point sink in front of the real one (resampling,
+ * if any, goes in front of this), keeping just the window.
+ * Points come out sm_window/2 behind, each with its smoothed
+ * altitude in salt, and smooth_end() (from read_fit) pushes out
+ * the ones still in the window at the end.
+ * Ascent, descent and min/max altitude pile up along the way.
+ *
+ * The median is found by counting, for each point in the window,
+ * how many are below it.  That is a little loop with no branches
+ * that the compiler can vectorize, and for 5 or 9 points it beats
+ * any clever sorting.
+ *
+ * -gW:T sets the window (points, odd) and threshold (feet).
+ */
+
+#define SM_WINDOW	5
+#define SM_THRESH	10.0
+#define SM_MAX		63
+
+/* Altitude raw values of 0xffffffff (no altitude) turn into this or less */
+#define NO_ALT		(-500.0 * M2F)
+
+int sm_on = 0;
+int sm_window = SM_WINDOW;
+double sm_thresh = SM_THRESH;
+
+void (*sm_sink) ( struct data * );
+
+struct data sm_pts[SM_MAX];	/* ring of the window */
+double sm_alt[SM_MAX];		/* same, just altitudes */
+int sm_n;			/* points in so far */
+int sm_out;			/* points out so far */
+
+double sm_ref;			/* altitude of the last count */
+int sm_have_ref;
+
+double sm_ascent;
+double sm_descent;
+double sm_min;
+double sm_max;
+
+/* Median of n altitudes */
+double
+sm_median ( double *a, int n )
+{
+	int i, j, below, same;
+	int k = n / 2;
+
+	for ( i=0; i<n; i++ ) {
+	    below = same = 0;
+	    for ( j=0; j<n; j++ ) {
+		below += a[j] < a[i];
+		same += a[j] == a[i];
+	    }
+	    if ( below <= k && below + same > k )
+		return a[i];
+	}
+	return a[k];	/* can't happen */
+}
+
+/* Push out the point at position i, its window being [lo, hi) */
+void
+sm_emit ( int i, int lo, int hi )
+{
+	double win[SM_MAX];
+	struct data *dp;
+	double s;
+	int j, n;
+
+	dp = &sm_pts[i % SM_MAX];
+
+	/* Points with no altitude don't get a vote */
+	for ( n = 0, j = lo; j < hi; j++ )
+	    if ( sm_alt[j % SM_MAX] > NO_ALT )
+		win[n++] = sm_alt[j % SM_MAX];
+
+	if ( n == 0 || dp->alt <= NO_ALT ) {
+	    dp->salt = dp->alt;
+	    sm_sink ( dp );
+	    return;
+	}
+
+	s = sm_median ( win, n );
+	dp->salt = s;
+
+	if ( ! sm_have_ref ) {
+	    sm_have_ref = 1;
+	    sm_ref = sm_min = sm_max = s;
+	}
+	if ( s - sm_ref >= sm_thresh ) {
+	    sm_ascent += s - sm_ref;
+	    sm_ref = s;
+	} else if ( sm_ref - s >= sm_thresh ) {
+	    sm_descent += sm_ref - s;
+	    sm_ref = s;
+	}
+	if ( s < sm_min )
+	    sm_min = s;
+	if ( s > sm_max )
+	    sm_max = s;
+
+	sm_sink ( dp );
+}
+
+void
+smooth_point ( struct data *dp )
+{
+	int half = sm_window / 2;
+	int i;
+
+	sm_pts[sm_n % SM_MAX] = *dp;
+	sm_alt[sm_n % SM_MAX] = dp->alt;
+	sm_n++;
+
+	/* The point half a window back now has everything it needs */
+	i = sm_n - 1 - half;
+	if ( i >= 0 ) {
+	    sm_emit ( i, i - half < 0 ? 0 : i - half, sm_n );
+	    sm_out = i + 1;
+	}
+}
+
+/* Out with the rest, with the window running off the end */
+void
+smooth_end ( void )
+{
+	int half = sm_window / 2;
+	int i;
+
+	if ( ! sm_sink )
+	    return;
+
+	for ( i = sm_out; i < sm_n; i++ )
+	    sm_emit ( i, i - half < 0 ? 0 : i - half, sm_n );
+	sm_out = sm_n;
+}
+
+/* Put the smoother in front of whatever the sink is now */
+void
+smooth_setup ( void )
+{
+	if ( ! sm_on )
+	    return;
+	sm_sink = point_sink;
+	point_sink = smooth_point;
+	sm_n = sm_out = 0;
+	sm_have_ref = 0;
+	sm_ascent = sm_descent = 0.0;
+}
+
+/* -gW or -gW:T */
+void
+smooth_arg ( char *arg )
+{
+	char *xp;
+
+	sm_on = 1;
+	if ( *arg )
+	    sm_window = strtol ( arg, &xp, 10 );
+	else
+	    xp = arg;
+	if ( *xp == ':' )
+	    sm_thresh = strtod ( xp+1, NULL );
+	if ( sm_window < 1 || sm_window > SM_MAX || ! (sm_window & 1) || sm_thresh < 0.0 )
+	    oops ( "Usage: -gwindow or -gwindow:feet (window odd, up to 63)" );
+}
+
+/* Extracting used to gather every point into data[] and then
+ * print them all at the end, so memory grew with the file and
+ * nothing came out until the whole thing was read.
+ * Now print_point is the point sink, and each point gets printed
+ * as soon as it is decoded.  Nothing piles up anywhere.
+ * With -f we flush after every point, for somebody (like g66i)
+ * reading the other end of a pipe who wants to see them right away.
+ */
+
+#define E_BUF		65536
+
+int e_flush = 0;
+__thread int e_count;
+
+/* With -c time,lat,lon (say) we print just those, in that order,
+ * and tell the decoder not to bother with anything else.
+ */
+#define MAX_COLS	16
+
+struct column {
+	char *name;
+	int col;
+} columns[] = {
+	{ "time", C_TIME },
+	{ "lon", C_LON },
+	{ "long", C_LON },
+	{ "lat", C_LAT },
+	{ "alt", C_ALT },
+	{ "temp", C_TEMP },
+	{ "speed", C_SPEED },
+	{ "dist", C_DIST },
+	{ "distance", C_DIST },
+	{ "salt", C_SALT },
+	{ NULL }
+};
+
+int col_list[MAX_COLS];
+int ncol = 0;			/* 0 means all, the usual way */
+
+void
+col_arg ( char *arg )
+{
+	struct column *cp;
+	char *p;
+	int n;
+
+	for ( p = arg; *p; p += n ) {
+	    if ( *p == ',' ) {
+		n = 1;
+		continue;
+	    }
+	    n = strcspn ( p, "," );
+	    for ( cp = columns; cp->name; cp++ )
+		if ( strlen ( cp->name ) == n && strncmp ( cp->name, p, n ) == 0 )
+		    break;
+	    if ( ! cp->name || ncol >= MAX_COLS )
+		oops ( "Usage: -c time,lon,lat,alt,temp,speed,dist (any of them, any order)" );
+	    col_list[ncol++] = cp->col;
+	}
+
+	if ( ncol == 0 )
+	    oops ( "No columns given with -c" );
+}
+
+void
+print_cols ( struct data *dp )
+{
+	int i, c;
+
+	for ( i=0; i<ncol; i++ ) {
+	    c = col_list[i];
+	    if ( i > 0 )
+		putchar ( ' ' );
+	    if ( c == C_TIME )
+		fputs ( tstamp(dp->time), stdout );
+	    else if ( c == C_LON )
+		printf ( "%.6f", dp->lon );
+	    else if ( c == C_LAT )
+		printf ( "%.6f", dp->lat );
+	    else if ( c == C_ALT )
+		printf ( "%.2f", dp->alt );
+	    else if ( c == C_TEMP )
+		printf ( "%.1f", dp->temp );
+	    else if ( c == C_SPEED )
+		printf ( "%.1f", dp->speed );
+	    else if ( c == C_SALT )
+		printf ( "%.2f", dp->salt );
+	    else
+		printf ( "%.1f", dp->distance );
+	}
+	putchar ( '\n' );
+}
+
+void
+print_point ( struct data *dp )
+{
+	/* A blank line at a gap, gnuplot style */
+	if ( dp->gap && e_count > 0 )
+	    printf ( "\n" );
+	if ( ncol )
+	    print_cols ( dp );
+	else if ( sm_on )
+	    printf ( "%s %.6f %.6f %.2f %.1f %.1f %.1f %.2f\n",
+		tstamp(dp->time), dp->lon, dp->lat, dp->alt, dp->temp, dp->speed, dp->distance, dp->salt );
+	else
+	    printf ( "%s %.6f %.6f %.2f %.1f %.1f %.1f\n",
+		tstamp(dp->time), dp->lon, dp->lat, dp->alt, dp->temp, dp->speed, dp->distance );
+	e_count++;
+
+	if ( e_flush )
+	    fflush ( stdout );
+}
+
+void resample_setup ( void );
+
+int pipe_mode = 0;		/* -p */
+int check_first = 0;		/* -v */
+void pipe_run ( char *, void (*) ( struct data * ) );
+
+void
+extract_file ( void )
+{
+	static char obuf[E_BUF];
+	int i;
+
+	if ( ! e_flush )
+	    setvbuf ( stdout, obuf, _IOFBF, E_BUF );
+
+	/* Only decode what we are going to print */
+	if ( ncol ) {
+	    dec_mask = 0;
+	    for ( i=0; i<ncol; i++ )
+		dec_mask |= col_list[i];
+	    if ( dec_mask & C_SALT ) {
+		dec_mask |= C_ALT;
+		sm_on = 1;
+	    }
+	}
+
+	if ( check_first )
+	    check_file ( in_path );
+
+	e_count = 0;
+	if ( pipe_mode ) {
+	    pipe_run ( in_path, print_point );
+	} else {
+	    point_sink = print_point;
+	    smooth_setup ();
+	    resample_setup ();
+	    read_file ();
+	}
+	fflush ( stdout );
+}
+
+/* --------------------------------------------------------- */
+/* Resampling --
+ *
+ * The 66i logs whenever it feels like it, every second when
+ * things are changing and every few minutes when I am sitting still.
+ * With -rN we put points on a fixed grid every N seconds instead,
+ * interpolating lat, long, altitude, speed and distance.
+ *
+ * Grid times are multiples of the step (so different files line up).
+ * If two points are more than the gap time apart (-rN:G, default
+ * 5 minutes) we don't make up points in between.  The next point
+ * after that gets flagged as a gap, and output shows a break there.
+ * Points with no GPS fix are a gap too, we don't want 180 degrees
+ * getting blended into the points on either side of them.
+ *
+ * This sits between decode() and the point store, keeping just the
+ * previous point, so the raw points never pile up anywhere.
+ */
+
+#define RS_GAP		300
+
+int rs_step = 0;		/* seconds, 0 means no resampling */
+int rs_gap = RS_GAP;
+
+struct data rs_prev;
+int rs_have_prev = 0;
+u32 rs_next;			/* next grid time */
+int rs_gap_flag = 0;		/* next output point starts a segment */
+
+void (*rs_sink) ( struct data * );
+
+int valid_point ( struct data * );
+
+void
+rs_emit ( struct data *dp )
+{
+	dp->gap = rs_gap_flag;
+	rs_gap_flag = 0;
+	rs_sink ( dp );
+}
+
+/* First grid time at or after t */
+u32
+rs_grid ( u32 t )
+{
+	return ((t + rs_step - 1) / rs_step) * rs_step;
+}
+
+void
+rs_start ( struct data *dp )
+{
+	struct data pt;
+
+	rs_prev = *dp;
+	rs_next = rs_grid ( dp->time );
+	if ( rs_next == dp->time ) {
+	    pt = *dp;
+	    rs_emit ( &pt );
+	    rs_next += rs_step;
+	}
+}
+
+void
+resample_point ( struct data *dp )
+{
+	struct data pt;
+	double f, span;
+
+	/* Start over at the next good one */
+	if ( ! valid_point ( dp ) ) {
+	    if ( rs_have_prev )
+		rs_gap_flag = 1;
+	    rs_have_prev = 0;
+	    return;
+	}
+
+	if ( ! rs_have_prev ) {
+	    rs_have_prev = 1;
+	    rs_start ( dp );
+	    return;
+	}
+
+	/* Duplicate (or backwards) times happen, just skip them */
+	if ( dp->time <= rs_prev.time )
+	    return;
+
+	if ( dp->time - rs_prev.time > rs_gap ) {
+	    rs_gap_flag = 1;
+	    rs_start ( dp );
+	    return;
+	}
+
+	span = dp->time - rs_prev.time;
+	while ( rs_next <= dp->time ) {
+	    f = (rs_next - rs_prev.time) / span;
+	    pt.time = rs_next;
+	    pt.lon = rs_prev.lon + f * (dp->lon - rs_prev.lon);
+	    pt.lat = rs_prev.lat + f * (dp->lat - rs_prev.lat);
+	    pt.alt = rs_prev.alt + f * (dp->alt - rs_prev.alt);
+	    pt.speed = rs_prev.speed + f * (dp->speed - rs_prev.speed);
+	    pt.distance = rs_prev.distance + f * (dp->distance - rs_prev.distance);
+	    pt.temp = f < 0.5 ? rs_prev.temp : dp->temp;
+	    pt.salt = pt.alt;
+	    rs_emit ( &pt );
+	    rs_next += rs_step;
+	}
+
+	rs_prev = *dp;
+}
+
+/* Put the resampler in front of whatever the sink is now */
+void
+resample_setup ( void )
+{
+	if ( rs_step <= 0 )
+	    return;
+	if ( rs_gap < rs_step )
+	    rs_gap = rs_step;
+	rs_sink = point_sink;
+	point_sink = resample_point;
+}
+
+/* -rN or -rN:G */
+void
+resample_arg ( char *arg )
+{
+	char *xp;
+
+	rs_step = strtol ( arg, &xp, 10 );
+	if ( *xp == ':' )
+	    rs_gap = strtol ( xp+1, NULL, 10 );
+	if ( rs_step <= 0 )
+	    oops ( "Usage: -rstep or -rstep:gap (seconds)" );
+}
+
+/* --------------------------------------------------------- */
+/* Exporters --
+ *
+ * fit66 -x gpx path     (or geojson, or csv)
+ *
+ * This is what gpsbabel used to do for me (see the Makefile).
+ * Points get written as they come out of the decoder
+ * (or the resampler), nothing is kept in memory.
+ * Times are UTC in ISO-8601, worked out with arithmetic
+ * rather than by asking localtime().
+ *
+ * GPX and GeoJSON want meters, so they get meters.
+ * CSV gets the same units as -e.
+ * A gap (see -r, or just rs_gap seconds with no points)
+ * starts a new track segment.
+ */
+
+enum xfmt { X_GPX, X_GEOJSON, X_CSV };
+
+enum xfmt x_fmt;
+char *x_name;
+int x_npoints;
+int x_nseg;
+int x_segpts;		/* points in this segment so far */
+u32 x_first;
+u32 x_last;
+struct data x_prev;
+
+#define X_BUF		65536
+
+/* Days since 1970 to year/month/day
+ * (from Howard Hinnant's "civil_from_days")
+ */
+char *
+iso_time ( u32 gtime )
+{
+	static char cbuf[32];
+	long t, days, secs;
+	long era, doe, yoe, doy, mp;
+	long y, m, d;
+
+	t = (long) gtime + FIT_OFFSET;
+	days = t / 86400;
+	secs = t % 86400;
+
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	doy = doe - (365*yoe + yoe/4 - yoe/100);
+	mp = (5*doy + 2) / 153;
+	d = doy - (153*mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = yoe + era * 400 + (m <= 2);
+
+	sprintf ( cbuf, "%04ld-%02ld-%02ldT%02ld:%02ld:%02ldZ",
+	    y, m, d, secs / 3600, (secs / 60) % 60, secs % 60 );
+	return cbuf;
+}
+
+/* File names can have anything in them */
+void
+export_name ( void )
+{
+	char *p;
+
+	for ( p=x_name; *p; p++ ) {
+	    if ( x_fmt == X_GPX && *p == '&' )
+		printf ( "&amp;" );
+	    else if ( x_fmt == X_GPX && *p == '<' )
+		printf ( "&lt;" );
+	    else if ( x_fmt == X_GEOJSON && (*p == '"' || *p == '\\') )
+		printf ( "\\%c", *p );
+	    else if ( x_fmt == X_GEOJSON && (u8) *p < 0x20 )
+		printf ( "\\u%04x", (u8) *p );
+	    else
+		putchar ( *p );
+	}
+}
+
+void
+export_start ( void )
+{
+	static char obuf[X_BUF];
+
+	setvbuf ( stdout, obuf, _IOFBF, X_BUF );
+
+	x_npoints = 0;
+	x_nseg = 0;
+
+	if ( x_fmt == X_GPX ) {
+	    printf ( "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" );
+	    printf ( "<gpx version=\"1.1\" creator=\"fit66\" xmlns=\"http://www.topografix.com/GPX/1/1\">\n" );
+	    printf ( "<trk>\n<name>" );
+	    export_name ();
+	    printf ( "</name>\n" );
+	} else if ( x_fmt == X_GEOJSON ) {
+	    printf ( "{\"type\": \"FeatureCollection\", \"features\": [\n" );
+	    printf ( "{\"type\": \"Feature\", \"geometry\": {\"type\": \"MultiLineString\", \"coordinates\": [" );
+	} else {
+	    printf ( "time,lat,long,alt_ft,temp_f,speed_mph,distance_mi,segment\n" );
+	}
+}
+
+/* A LineString needs two points, so a lone point gets doubled */
+void
+geojson_close ( void )
+{
+	if ( x_nseg == 0 )
+	    return;
+	if ( x_segpts == 1 )
+	    printf ( ",[%.7f,%.7f,%.1f]", x_prev.lon, x_prev.lat, x_prev.alt / M2F );
+	printf ( "]" );
+}
+
+void
+export_point ( struct data *dp )
+{
+	int new_seg;
+
+	if ( x_fmt != X_CSV && ! valid_point ( dp ) )
+	    return;
+
+	new_seg = x_npoints == 0 || dp->gap || dp->time - x_last > rs_gap;
+	if ( x_npoints == 0 )
+	    x_first = dp->time;
+
+	if ( x_fmt == X_GPX ) {
+	    if ( new_seg ) {
+		if ( x_nseg )
+		    printf ( "</trkseg>\n" );
+		printf ( "<trkseg>\n" );
+	    }
+	    printf ( "<trkpt lat=\"%.7f\" lon=\"%.7f\"><ele>%.1f</ele><time>%s</time></trkpt>\n",
+		dp->lat, dp->lon, dp->alt / M2F, iso_time ( dp->time ) );
+	} else if ( x_fmt == X_GEOJSON ) {
+	    if ( new_seg ) {
+		geojson_close ();
+		printf ( "%s\n[", x_nseg ? "," : "" );
+	    } else
+		printf ( "," );
+	    printf ( "[%.7f,%.7f,%.1f]", dp->lon, dp->lat, dp->alt / M2F );
+	} else {
+	    if ( valid_point ( dp ) )
+		printf ( "%s,%.7f,%.7f,", iso_time ( dp->time ), dp->lat, dp->lon );
+	    else
+		printf ( "%s,,,", iso_time ( dp->time ) );
+	    printf ( "%.2f,%.1f,%.2f,%.3f,%d\n",
+		dp->alt, dp->temp, dp->speed, dp->distance, x_nseg + new_seg );
+	}
+
+	if ( new_seg )
+	    x_segpts = 0;
+	x_nseg += new_seg;
+	x_segpts++;
+	x_npoints++;
+	x_last = dp->time;
+	x_prev = *dp;
+}
+
+void
+export_end ( void )
+{
+	if ( x_fmt == X_GPX ) {
+	    if ( x_nseg )
+		printf ( "</trkseg>\n" );
+	    printf ( "</trk>\n</gpx>\n" );
+	} else if ( x_fmt == X_GEOJSON ) {
+	    /* Properties can come last, once we know them */
+	    geojson_close ();
+	    printf ( "\n]},\n\"properties\": {\"name\": \"" );
+	    export_name ();
+	    printf ( "\", \"points\": %d", x_npoints );
+	    if ( x_npoints ) {
+		printf ( ", \"start\": \"%s\"", iso_time ( x_first ) );
+		printf ( ", \"end\": \"%s\"", iso_time ( x_last ) );
+	    }
+	    printf ( "}}\n]}\n" );
+	}
+	fflush ( stdout );
+}
+
+void
+export_arg ( char *arg )
+{
+	if ( strcmp ( arg, "gpx" ) == 0 )
+	    x_fmt = X_GPX;
+	else if ( strcmp ( arg, "geojson" ) == 0 )
+	    x_fmt = X_GEOJSON;
+	else if ( strcmp ( arg, "csv" ) == 0 )
+	    x_fmt = X_CSV;
+	else
+	    oops ( "Usage: fit66 -x gpx|geojson|csv path" );
+}
+
+void
+export_file ( char *path )
+{
+	char *p;
+
+	/* The track is named after the file */
+	x_name = path;
+	if ( (p = strrchr ( path, '/' )) )
+	    x_name = p + 1;
+
+	if ( check_first )
+	    check_file ( path );
+
+	export_start ();
+	if ( pipe_mode ) {
+	    pipe_run ( path, export_point );
+	} else {
+	    point_sink = export_point;
+	    resample_setup ();
+	    read_fit ( path );
+	}
+	export_end ();
+}
+
+/* --------------------------------------------------------- */
+/* Pipelining --
+ *
+ * Normally one thread reads, then decodes, then prints, and
+ * none of that overlaps.  With -p (for -e and -x) there are three
+ * threads instead, each doing one of those jobs:
+ *
+ *   reader -- fills PIPE_CHUNK byte chunks from the file
+ *   decoder -- runs the usual parser on those, and packs the
+ *	points (after resampling, if any) into batches
+ *   writer -- (the main thread) formats and prints the batches
+ *
+ * Chunks and batches are allocated once, up front, and never copied.
+ * The parser reads right out of the chunks (in_buf points into them),
+ * and make_point builds points right in the batch (see pipe_slot).
+ * The only copying is the few bytes of a message that runs off the
+ * end of one chunk, which go in the space in front of the next one.
+ * Pointers to them go around in rings, a "full" ring forward to
+ * the next stage and a "free" ring back to the one before.
+ * Each ring has just one thread putting and one thread getting,
+ * so all it takes is a head and a tail and some care about the
+ * order things get seen in, no locks.
+ * A NULL in a full ring means the end.
+ * A thread that has to wait spins a little, then sleeps on a futex
+ * (the head or tail it is waiting on), so a stage that is stuck
+ * behind a slow one doesn't burn a whole cpu.
+ *
+ * The whole thing goes as fast as the slowest stage
+ * (which is usually printf).
+ */
+
+#define PIPE_RING	8		/* power of 2 */
+#define PIPE_CHUNK	65536
+#define PIPE_POINTS	1024
+#define PIPE_SPIN	100		/* tries before going to sleep */
+
+struct ring {
+	void *slot[PIPE_RING];
+	unsigned head __attribute__((aligned(64)));	/* getter owns this */
+	int put_wait;					/* putter sleeps on head */
+	unsigned tail __attribute__((aligned(64)));	/* putter owns this */
+	int get_wait;					/* getter sleeps on tail */
+};
+
+/* The leftover bytes from the last chunk go in pre,
+ * right in front of buf, so the parser sees them together.
+ */
+struct chunk {
+	int len;
+	u8 pre[IN_BUF];
+	u8 buf[PIPE_CHUNK];
+};
+
+struct pbatch {
+	int n;
+	struct data pt[PIPE_POINTS];
+};
+
+struct ring p_chunk_full, p_chunk_free;
+struct ring p_batch_full, p_batch_free;
+struct chunk *p_chunks[PIPE_RING];
+struct pbatch *p_batches[PIPE_RING];
+char *p_path;
+
+struct chunk *p_chunk;		/* decoder's current chunk */
+int p_eof;
+int p_failed;
+struct pbatch *p_batch;		/* decoder's current batch */
+
+static void
+ring_relax ( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause ();
+#endif
+}
+
+/* Sleep as long as *addr is still val */
+static void
+futex_wait ( unsigned *addr, unsigned val )
+{
+	syscall ( __NR_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+static void
+futex_wake ( unsigned *addr )
+{
+	syscall ( __NR_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+}
+
+/* Going to sleep, we say so (the wait flag) and then look again.
+ * Waking, the other side moves its head or tail and then looks at
+ * the flag.  With everything seq_cst, one of us sees the other,
+ * and the futex itself won't sleep if the value already moved.
+ */
+void
+ring_put ( struct ring *rp, void *p )
+{
+	unsigned tail = rp->tail;
+	unsigned head;
+	int spin = 0;
+
+	for ( ;; ) {
+	    head = __atomic_load_n ( &rp->head, __ATOMIC_SEQ_CST );
+	    if ( tail - head < PIPE_RING )
+		break;
+	    if ( spin++ < PIPE_SPIN ) {
+		ring_relax ();
+		continue;
+	    }
+	    __atomic_store_n ( &rp->put_wait, 1, __ATOMIC_SEQ_CST );
+	    head = __atomic_load_n ( &rp->head, __ATOMIC_SEQ_CST );
+	    if ( tail - head >= PIPE_RING )
+		futex_wait ( &rp->head, head );
+	}
+
+	rp->slot[tail & (PIPE_RING-1)] = p;
+	__atomic_store_n ( &rp->tail, tail + 1, __ATOMIC_SEQ_CST );
+
+	if ( __atomic_load_n ( &rp->get_wait, __ATOMIC_SEQ_CST ) ) {
+	    __atomic_store_n ( &rp->get_wait, 0, __ATOMIC_SEQ_CST );
+	    futex_wake ( &rp->tail );
+	}
+}
+
+void *
+ring_get ( struct ring *rp )
+{
+	unsigned head = rp->head;
+	unsigned tail;
+	int spin = 0;
+	void *p;
+
+	for ( ;; ) {
+	    tail = __atomic_load_n ( &rp->tail, __ATOMIC_SEQ_CST );
+	    if ( tail != head )
+		break;
+	    if ( spin++ < PIPE_SPIN ) {
+		ring_relax ();
+		continue;
+	    }
+	    __atomic_store_n ( &rp->get_wait, 1, __ATOMIC_SEQ_CST );
+	    tail = __atomic_load_n ( &rp->tail, __ATOMIC_SEQ_CST );
+	    if ( tail == head )
+		futex_wait ( &rp->tail, tail );
+	}
+
+	p = rp->slot[head & (PIPE_RING-1)];
+	__atomic_store_n ( &rp->head, head + 1, __ATOMIC_SEQ_CST );
+
+	if ( __atomic_load_n ( &rp->put_wait, __ATOMIC_SEQ_CST ) ) {
+	    __atomic_store_n ( &rp->put_wait, 0, __ATOMIC_SEQ_CST );
+	    futex_wake ( &rp->head );
+	}
+	return p;
+}
+
+void *
+pipe_reader ( void *arg )
+{
+	struct chunk *cp;
+	int n;
+
+	open_fit ( p_path );
+
+	for ( ;; ) {
+	    cp = ring_get ( &p_chunk_free );
+	    for ( cp->len = 0; cp->len < PIPE_CHUNK; cp->len += n ) {
+		n = read ( fit_fd, &cp->buf[cp->len], PIPE_CHUNK - cp->len );
+		if ( n <= 0 )
+		    break;
+	    }
+	    if ( cp->len == 0 )
+		break;		/* this one just never goes back */
+	    ring_put ( &p_chunk_full, cp );
+	}
+
+	/* Let the parser complain if the file came up short */
+	ring_put ( &p_chunk_full, NULL );
+	if ( fit_fd > 0 )
+	    close ( fit_fd );
+	return NULL;
+}
+
+/* Called by in_fill() in the decoder when in_buf runs short.
+ * We move on to the next chunk, with whatever was left of this
+ * one (less than n bytes) copied in front of it.
+ */
+int
+pipe_fill ( int n )
+{
+	struct chunk *next;
+	int left;
+
+	while ( in_len - in_pos < n && ! p_eof ) {
+	    next = ring_get ( &p_chunk_full );
+	    if ( ! next ) {
+		p_eof = 1;
+		break;
+	    }
+
+	    left = in_len - in_pos;
+	    memcpy ( next->buf - left, &in_buf[in_pos], left );
+	    if ( p_chunk )
+		ring_put ( &p_chunk_free, p_chunk );
+	    p_chunk = next;
+
+	    in_buf = next->buf - left;
+	    in_pos = 0;
+	    in_len = left + next->len;
+	}
+
+	return in_len - in_pos < n ? in_len - in_pos : n;
+}
+
+/* Where make_point should put the next point */
+struct data *
+pipe_slot ( void )
+{
+	if ( ! p_batch ) {
+	    p_batch = ring_get ( &p_batch_free );
+	    p_batch->n = 0;
+	}
+	return &p_batch->pt[p_batch->n];
+}
+
+/* The point sink in the decoder.
+ * Points from make_point are already in place, but the resampler
+ * and smoother make their own.
+ */
+void
+pipe_point ( struct data *dp )
+{
+	if ( dp != pipe_slot () )
+	    p_batch->pt[p_batch->n] = *dp;
+	p_batch->n++;
+
+	if ( p_batch->n >= PIPE_POINTS ) {
+	    ring_put ( &p_batch_full, p_batch );
+	    p_batch = NULL;
+	}
+}
+
+void *
+pipe_decoder ( void *arg )
+{
+	jmp_buf jb;
+
+	/* On trouble, send along the points we have before giving up */
+	in_pipe = 1;
+	if ( setjmp ( jb ) )
+	    p_failed = 1;
+	else {
+	    oops_jmp = &jb;
+	    read_fit ( p_path );
+	}
+	oops_jmp = NULL;
+
+	if ( p_batch )
+	    ring_put ( &p_batch_full, p_batch );
+	ring_put ( &p_batch_full, NULL );
+
+	/* If the parser stopped early, keep the reader from getting stuck */
+	while ( ! p_eof ) {
+	    if ( p_chunk )
+		ring_put ( &p_chunk_free, p_chunk );
+	    p_chunk = ring_get ( &p_chunk_full );
+	    if ( ! p_chunk )
+		p_eof = 1;
+	}
+	return NULL;
+}
+
+/* Run the file through the pipeline, out() gets every point */
+void
+pipe_run ( char *path, void (*out) ( struct data * ) )
+{
+	pthread_t reader, decoder;
+	struct pbatch *bp;
+	int i;
+
+	memset ( &p_chunk_full, 0, sizeof(struct ring) );
+	memset ( &p_chunk_free, 0, sizeof(struct ring) );
+	memset ( &p_batch_full, 0, sizeof(struct ring) );
+	memset ( &p_batch_free, 0, sizeof(struct ring) );
+
+	for ( i=0; i<PIPE_RING; i++ ) {
+	    p_chunks[i] = malloc ( sizeof(struct chunk) );
+	    p_batches[i] = malloc ( sizeof(struct pbatch) );
+	    if ( ! p_chunks[i] || ! p_batches[i] )
+		oops ( "Out of memory for pipeline" );
+	    ring_put ( &p_chunk_free, p_chunks[i] );
+	    ring_put ( &p_batch_free, p_batches[i] );
+	}
+
+	p_path = path;
+	p_chunk = NULL;
+	p_eof = 0;
+	p_failed = 0;
+	p_batch = NULL;
+
+	point_sink = pipe_point;
+	smooth_setup ();
+	resample_setup ();
+	if ( point_sink == pipe_point )
+	    point_here = pipe_slot;
+
+	if ( pthread_create ( &reader, NULL, pipe_reader, NULL ) ||
+		pthread_create ( &decoder, NULL, pipe_decoder, NULL ) )
+	    oops ( "Cannot create thread" );
+
+	while ( (bp = ring_get ( &p_batch_full )) ) {
+	    for ( i=0; i<bp->n; i++ )
+		out ( &bp->pt[i] );
+	    ring_put ( &p_batch_free, bp );
+	}
+
+	pthread_join ( decoder, NULL );
+	pthread_join ( reader, NULL );
+	point_here = NULL;
+
+	if ( p_failed ) {
+	    fflush ( stdout );
+	    exit ( 1 );
+	}
+
+	for ( i=0; i<PIPE_RING; i++ ) {
+	    free ( p_chunks[i] );
+	    free ( p_batches[i] );
+	}
+}
+
+/* --------------------------------------------------------- */
+/* Splitting --
+ *
+ * fit66 -sSPEC in.fit prefix
+ *
+ * cuts one file into several (prefix-1.fit, prefix-2.fit ...)
+ * in a single pass, where SPEC is one of:
+ *
+ *   -s1800		a new file after a gap of more than 1800 seconds
+ *   -se		a new file after each timer stop event
+ *   -s1:100,250:400	windows of records (numbered from 1, like -t)
+ *   -s2023-07-12T20:00:00/2023-07-12T22:00:00,...
+ *			windows of UTC time
+ *
+ * Windows can overlap, in which case the records go to both.
+ * Everything before the first record (file ID, creator,
+ * device info ...) goes at the front of every output.
+ * After that, other messages go to whatever outputs are open,
+ * and an output stays open until the next record that doesn't
+ * belong in it, so the lap and session messages that follow
+ * the last record go along with it.
+ *
+ * Each output is its own fit_out, with its own definitions,
+ * header and CRC kept up to date as it is written.
+ */
+
+enum smode { S_GAP, S_EVENT, S_RECORDS, S_TIMES };
+
+#define S_MAXWIN	256
+
+struct swin {
+	u32 start;
+	u32 end;
+	struct fit_out *op;
+	char *path;
+	int nrec;
+	u32 t0, t1;
+};
+
+/* A message saved up to go at the front of each output */
+struct smsg {
+	struct ldef def;
+	u8 *msg;
+	int comp;
+	u32 ts;
+};
+
+enum smode s_mode;
+u32 s_gap;
+struct swin s_win[S_MAXWIN];
+int s_nwin;
+char *s_prefix;
+int s_nout;
+
+struct smsg *s_pre;
+int s_npre;
+int s_maxpre;
+
+#define GID_EVENT	21
+#define EVENT_TIMER	0
+
+/* Year/month/day to days since 1970 (Howard Hinnant's "days_from_civil") */
+long
+civil_days ( long y, long m, long d )
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/* 2023-07-12T20:40:30 (UTC) to FIT time */
+u32
+iso_parse ( char *s )
+{
+	int y, mo, d, h = 0, mi = 0, sec = 0;
+
+	if ( sscanf ( s, "%d-%d-%dT%d:%d:%d", &y, &mo, &d, &h, &mi, &sec ) < 3 )
+	    oops ( "Bad time, use 2023-07-12T20:40:30" );
+
+	return civil_days ( y, mo, d ) * 86400 + h * 3600 + mi * 60 + sec - FIT_OFFSET;
+}
+
+void
+split_arg ( char *arg )
+{
+	char *p, *q;
+	int gap;
+
+	if ( strcmp ( arg, "e" ) == 0 ) {
+	    s_mode = S_EVENT;
+	    return;
+	}
+
+	if ( ! strchr ( arg, ':' ) ) {
+	    s_mode = S_GAP;
+	    gap = atoi ( arg );
+	    if ( gap <= 0 )
+		oops ( "Usage: -sgap, -se, -sstart:end,... or -stime/time,..." );
+	    s_gap = gap;
+	    return;
+	}
+
+	s_mode = strchr ( arg, 'T' ) ? S_TIMES : S_RECORDS;
+	for ( p = arg; p && *p; p = q ) {
+	    q = strchr ( p, ',' );
+	    if ( q )
+		q++;
+	    if ( s_nwin >= S_MAXWIN )
+		oops ( "Too many split windows" );
+	    if ( s_mode == S_TIMES ) {
+		s_win[s_nwin].start = iso_parse ( p );
+		p = strchr ( p, '/' );
+		if ( ! p || (q && p > q) )
+		    oops ( "Time windows look like start/end" );
+		s_win[s_nwin].end = iso_parse ( p+1 );
+	    } else {
+		s_win[s_nwin].start = strtol ( p, &p, 10 );
+		if ( *p != ':' )
+		    oops ( "Record windows look like start:end" );
+		s_win[s_nwin].end = strtol ( p+1, NULL, 10 );
+	    }
+	    s_nwin++;
+	}
+}
+
+/* Send a message to an output, by way of a fake cursor */
+void
+split_send ( struct fit_out *op, struct ldef *dp, u8 *msg, int comp, u32 ts )
+{
+	struct cursor tmp;
+
+	tmp.dp = dp;
+	tmp.msg = msg;
+	tmp.comp = comp;
+	tmp.ts = ts;
+	out_message ( op, &tmp );
+}
+
+void
+split_open ( struct swin *wp )
+{
+	char path[1024];
+	int i;
+
+	snprintf ( path, sizeof(path), "%s-%d.fit", s_prefix, ++s_nout );
+	wp->path = strdup ( path );
+	wp->op = out_open ( wp->path );
+	wp->nrec = 0;
+
+	for ( i=0; i<s_npre; i++ )
+	    split_send ( wp->op, &s_pre[i].def, s_pre[i].msg, s_pre[i].comp, s_pre[i].ts );
+}
+
+void
+split_close ( struct swin *wp, struct fit_header *proto )
+{
+	if ( ! wp->op )
+	    return;
+
+	printf ( "%s: %d records, %s", wp->path, wp->nrec, iso_time ( wp->t0 ) );
+	printf ( " to %s\n", iso_time ( wp->t1 ) );
+
+	out_close ( wp->op, proto );
+	wp->op = NULL;
+	free ( wp->path );
+}
+
+/* Is this a timer stop event? */
+int
+split_stop ( struct cursor *cp )
+{
+	struct ldef *dp = cp->dp;
+	int event = -1, type = -1;
+	int off = 1;
+	int i;
+
+	if ( dp->gid != GID_EVENT )
+	    return 0;
+
+	for ( i=0; i<dp->raw[5]; i++ ) {
+	    if ( dp->raw[6+i*3] == 0 )
+		event = cp->msg[off];
+	    if ( dp->raw[6+i*3] == 1 )
+		type = cp->msg[off];
+	    off += dp->raw[6+i*3+1];
+	}
+
+	/* stop, stop_all, stop_disable, stop_disable_all */
+	return event == EVENT_TIMER && (type == 1 || type == 4 || type == 8 || type == 9);
+}
+
+void
+split_file ( char *in )
+{
+	struct cursor cur, *cp = &cur;
+	struct swin *wp;
+	u32 nrec = 0;
+	u32 key;
+	u32 last_t = 0;
+	int cut = 0;
+	u8 *buf;
+	int len;
+	int in_win;
+	int i;
+
+	buf = load_file ( in, &len );
+	cursor_open ( cp, buf, len );
+
+	/* Gap and event splits use just one window, over and over */
+	if ( s_mode == S_GAP || s_mode == S_EVENT )
+	    s_nwin = 1;
+
+	while ( cursor_next ( cp ) ) {
+	    if ( cp->dp->gid != GID_RECORD ) {
+		if ( nrec == 0 ) {
+		    if ( s_npre >= s_maxpre ) {
+			s_maxpre = s_maxpre ? s_maxpre * 2 : 32;
+			s_pre = realloc ( s_pre, s_maxpre * sizeof(struct smsg) );
+			if ( ! s_pre )
+			    oops ( "Out of memory for split" );
+		    }
+		    s_pre[s_npre].def = *cp->dp;
+		    s_pre[s_npre].msg = cp->msg;
+		    s_pre[s_npre].comp = cp->comp;
+		    s_pre[s_npre].ts = cp->ts;
+		    s_npre++;
+		    continue;
+		}
+
+		for ( i=0; i<s_nwin; i++ )
+		    if ( s_win[i].op )
+			split_send ( s_win[i].op, cp->dp, cp->msg, cp->comp, cp->ts );
+
+		if ( s_mode == S_EVENT && split_stop ( cp ) )
+		    cut = 1;
+		continue;
+	    }
+
+	    /* A record */
+	    nrec++;
+
+	    if ( s_mode == S_GAP || s_mode == S_EVENT ) {
+		wp = &s_win[0];
+		if ( ! wp->op || cut || (s_mode == S_GAP && cp->ts - last_t > s_gap) ) {
+		    split_close ( wp, &cp->hdr );
+		    split_open ( wp );
+		    cut = 0;
+		}
+	    }
+
+	    for ( i=0; i<s_nwin; i++ ) {
+		wp = &s_win[i];
+		key = s_mode == S_TIMES ? cp->ts : nrec;
+		in_win = s_mode == S_GAP || s_mode == S_EVENT ||
+		    (key >= wp->start && key <= wp->end);
+
+		if ( ! in_win ) {
+		    if ( wp->op && key > wp->end )
+			split_close ( wp, &cp->hdr );
+		    continue;
+		}
+
+		if ( ! wp->op )
+		    split_open ( wp );
+		if ( wp->nrec == 0 )
+		    wp->t0 = cp->ts;
+		wp->t1 = cp->ts;
+		wp->nrec++;
+		split_send ( wp->op, cp->dp, cp->msg, cp->comp, cp->ts );
+	    }
+
+	    last_t = cp->ts;
+	}
+
+	for ( i=0; i<s_nwin; i++ )
+	    split_close ( &s_win[i], &cp->hdr );
+
+	printf ( "Split %d records into %d files\n", nrec, s_nout );
+
+	free ( s_pre );
+	free ( buf );
+}
+
+/* --------------------------------------------------------- */
+/* Derived metrics --
+ *
+ * The 66i hands us distance and speed (fields 5 and 73),
+ * but that is whatever the device decided they should be.
+ * Here we work things out for ourselves from lat/long
+ * using the wgs84() model above.
+ *
+ * Calling wgs84() for every point would be silly.  It is all
+ * sin/cos/sqrt and my tracks hardly move in latitude, so the
+ * feet-per-degree values get cached in latitude bands.
+ * A band of 0.01 degree is about 3600 feet, and the scale
+ * changes by way less than a foot per mile across it.
+ *
+ * The work is done in blocks.  First we gather differences
+ * into little arrays and get one scale factor for the block,
+ * then we run a plain loop over those with no calls and no branches,
+ * which the compiler is happy to vectorize (see -O2 in the Makefile).
+ * The cumulative sums are done last, since they are serial.
+ */
+
+#define BAND_SCALE	100	/* bands per degree */
+#define NBAND		64	/* band cache entries */
+
+struct band {
+	int valid;
+	int band;
+	double long_fpd;
+	double lat_fpd;
+};
+
+__thread struct band band_cache[NBAND];
+
+/* Anything slower than this (miles per hour) is "not moving" */
+#define MOVE_MPH	0.5
+
+/* Segments shorter than this (feet) give garbage grades */
+#define MIN_GRADE_FT	3.0
+
+#define MBLOCK		64
+
+/* One column per derived value, indexed like data[] */
+__thread double *m_seg;		/* feet from previous point */
+__thread double *m_cum;		/* cumulative miles */
+__thread double *m_grade;	/* percent */
+__thread double *m_vspeed;	/* feet per minute */
+__thread u8 *m_moving;
+__thread int m_max;
+
+__thread u32 moving_time;	/* seconds */
+
+void
+metrics_grow ( void )
+{
+	if ( m_max >= ndata )
+	    return;
+
+	m_max = max_data;
+	m_seg = realloc ( m_seg, m_max * sizeof(double) );
+	m_cum = realloc ( m_cum, m_max * sizeof(double) );
+	m_grade = realloc ( m_grade, m_max * sizeof(double) );
+	m_vspeed = realloc ( m_vspeed, m_max * sizeof(double) );
+	m_moving = realloc ( m_moving, m_max );
+	if ( ! m_seg || ! m_cum || ! m_grade || ! m_vspeed || ! m_moving )
+	    oops ( "Out of memory for metrics" );
+}
+
+void
+band_scale ( double lat, double *long_fpd, double *lat_fpd )
+{
+	struct band *bp;
+	int band;
+
+	band = (int) floor ( lat * BAND_SCALE );
+	bp = &band_cache[band & (NBAND-1)];
+
+	if ( ! bp->valid || bp->band != band ) {
+	    wgs84 ( (band + 0.5) / BAND_SCALE, &bp->long_fpd, &bp->lat_fpd );
+	    bp->band = band;
+	    bp->valid = 1;
+	}
+
+	*long_fpd = bp->long_fpd;
+	*lat_fpd = bp->lat_fpd;
+}
+
+void
+derive_metrics ( void )
+{
+	double dlon[MBLOCK], dlat[MBLOCK], dalt[MBLOCK], dt[MBLOCK];
+	double kx, ky;
+	double seg[MBLOCK], grade[MBLOCK], vspeed[MBLOCK], fps[MBLOCK];
+	double move_fps = MOVE_MPH * 5280.0 / 3600.0;
+	double cum;
+	struct data pt, prev, *dp;
+	int have_prev;
+	int base, nb;
+	int i, j;
+
+	moving_time = 0;
+	if ( ndata < 1 )
+	    return;
+
+	metrics_grow ();
+
+	cum = 0.0;
+	have_prev = 0;
+
+	for ( base=0; base<ndata; base += MBLOCK ) {
+	    nb = ndata - base;
+	    if ( nb > MBLOCK )
+		nb = MBLOCK;
+
+	    /* Gather.  A point with no fix gets all zeros, and the
+	     * next good one is measured from the last good one.
+	     * No altitude on either end gives no climb.
+	     */
+	    for ( j=0; j<nb; j++ ) {
+		i = base + j;
+		dp = get_point ( i, &pt );
+		dlon[j] = dlat[j] = dalt[j] = dt[j] = 0.0;
+		if ( ! valid_point ( dp ) )
+		    continue;
+		if ( have_prev ) {
+		    dlon[j] = dp->lon - prev.lon;
+		    dlat[j] = dp->lat - prev.lat;
+		    if ( dp->alt > NO_ALT && prev.alt > NO_ALT )
+			dalt[j] = dp->alt - prev.alt;
+		    dt[j] = (double) dp->time - (double) prev.time;
+		}
+		prev = *dp;
+		have_prev = 1;
+	    }
+
+	    /* One scale does for the whole block,
+	     * 64 points don't go far in latitude.
+	     */
+	    kx = ky = 0.0;
+	    if ( have_prev )
+		band_scale ( prev.lat, &kx, &ky );
+
+	    /* The part that vectorizes */
+	    for ( j=0; j<nb; j++ ) {
+		double dx = dlon[j] * kx;
+		double dy = dlat[j] * ky;
+
+		seg[j] = sqrt ( dx*dx + dy*dy );
+		grade[j] = seg[j] > MIN_GRADE_FT ? 100.0 * dalt[j] / seg[j] : 0.0;
+		vspeed[j] = dt[j] > 0.0 ? 60.0 * dalt[j] / dt[j] : 0.0;
+		fps[j] = dt[j] > 0.0 ? seg[j] / dt[j] : 0.0;
+	    }
+
+	    /* Scatter, and the serial sums */
+	    for ( j=0; j<nb; j++ ) {
+		i = base + j;
+		cum += seg[j] / 5280.0;
+		m_seg[i] = seg[j];
+		m_cum[i] = cum;
+		m_grade[i] = grade[j];
+		m_vspeed[i] = vspeed[j];
+		m_moving[i] = fps[j] > move_fps;
+		if ( m_moving[i] )
+		    moving_time += dt[j];
+	    }
+	}
+}
+
+char *
+hms ( u32 secs )
+{
+	static char cbuf[32];
+
+	sprintf ( cbuf, "%d:%02d:%02d", secs / 3600, (secs / 60) % 60, secs % 60 );
+	return cbuf;
+}
+
+void
+show_metrics ( void )
+{
+	int i;
+	u32 elapsed;
+	double miles;
+	struct data pt, *dp;
+	u32 t0;
+
+	derive_metrics ();
+
+	for ( i=0; i<ndata; i++ ) {
+	    dp = get_point ( i, &pt );
+	    printf ( "%s %.1f %.3f %.1f %.1f %d\n",
+		tstamp(dp->time), m_seg[i], m_cum[i], m_grade[i], m_vspeed[i], m_moving[i] );
+	}
+
+	if ( ndata < 1 )
+	    return;
+
+	t0 = get_point ( 0, &pt ) -> time;
+	dp = get_point ( ndata-1, &pt );
+	elapsed = dp->time - t0;
+	miles = m_cum[ndata-1];
+
+	printf ( "\n" );
+	printf ( "Points: %d (%d records: %d fast path, %d generic)\n",
+	    ndata, n_fast + n_generic, n_fast, n_generic );
+	printf ( "Distance: %.3f miles (device says %.3f)\n", miles, dp->distance );
+	printf ( "Elapsed time: %s\n", hms ( elapsed ) );
+	printf ( "Moving time: %s\n", hms ( moving_time ) );
+	if ( moving_time )
+	    printf ( "Moving speed: %.2f mph\n", miles * 3600.0 / moving_time );
+	if ( sm_have_ref ) {
+	    printf ( "Ascent: %.0f feet, descent: %.0f feet (median of %d, %.0f foot threshold)\n",
+		sm_ascent, sm_descent, sm_window, sm_thresh );
+	    printf ( "Altitude: %.0f to %.0f feet\n", sm_min, sm_max );
+	}
+}
+
+/* --------------------------------------------------------- */
+/* Nearest point --
+ *
+ * g66i steps through a track by index, which is fine, but clicking
+ * on the map to jump to the nearest point meant a linear scan
+ * over the whole list in Python.  Not nice with 100k points.
+ *
+ * So here is a k-d tree over the points, in feet, using the
+ * wgs84() scale (by way of the band cache above) relative to
+ * the middle of the track.  It is "implicit" -- we just reorder
+ * an array so that the middle of any range splits it, alternating
+ * between x and y, so there are no pointers and no nodes.
+ * Building is n log n, a query is log n (give or take).
+ *
+ * kd_build () makes the tree from whatever is in data[],
+ * kd_nearest () and kd_within () answer questions.
+ *
+ * fit66 -n path reads questions on stdin, one per line:
+ *   lat long		-- the nearest point
+ *   lat long feet	-- every point within that many feet, nearest first
+ * and answers with a count line, then "index feet" lines,
+ * where index counts from 1 like g66i (and -t) do.
+ * Output gets flushed after every answer, so g66i can keep
+ * one of these running on a pipe.
+ */
+
+struct kd_point {
+	double x;
+	double y;
+	int index;
+};
+
+struct kd_hit {
+	int index;
+	double feet;
+};
+
+__thread struct kd_point *kd_pts;
+__thread int kd_npts;
+__thread double kd_lat0;
+__thread double kd_lon0;
+
+__thread struct kd_hit *kd_hits;
+__thread int kd_nhits;
+__thread int kd_maxhits;
+
+/* Lat/long to feet from the middle of the track */
+void
+kd_feet ( double lat, double lon, double *x, double *y )
+{
+	double long_fpd, lat_fpd;
+
+	band_scale ( lat, &long_fpd, &lat_fpd );
+	*x = (lon - kd_lon0) * long_fpd;
+	*y = (lat - kd_lat0) * lat_fpd;
+}
+
+static inline double
+kd_key ( struct kd_point *pp, int axis )
+{
+	return axis ? pp->y : pp->x;
+}
+
+/* Quickselect, so that pts[k] has the right value on the axis,
+ * smaller ones below it and bigger ones above.
+ */
+void
+kd_select ( struct kd_point *pts, int n, int k, int axis )
+{
+	struct kd_point tmp;
+	int lo = 0, hi = n - 1;
+	int i, j;
+	double pivot;
+
+	while ( lo < hi ) {
+	    pivot = kd_key ( &pts[(lo + hi) / 2], axis );
+	    i = lo;
+	    j = hi;
+	    while ( i <= j ) {
+		while ( kd_key ( &pts[i], axis ) < pivot )
+		    i++;
+		while ( kd_key ( &pts[j], axis ) > pivot )
+		    j--;
+		if ( i <= j ) {
+		    tmp = pts[i];
+		    pts[i] = pts[j];
+		    pts[j] = tmp;
+		    i++;
+		    j--;
+		}
+	    }
+	    if ( k <= j )
+		hi = j;
+	    else if ( k >= i )
+		lo = i;
+	    else
+		break;
+	}
+}
+
+void
+kd_split ( struct kd_point *pts, int n, int axis )
+{
+	int mid = n / 2;
+
+	if ( n < 2 )
+	    return;
+
+	kd_select ( pts, n, mid, axis );
+	kd_split ( pts, mid, !axis );
+	kd_split ( pts + mid + 1, n - mid - 1, !axis );
+}
+
+void
+kd_build ( void )
+{
+	struct data pt, *dp;
+	double s, n, w, e;
+	int i;
+
+	s = w = 1000.0;
+	n = e = -1000.0;
+	for ( i=0; i<ndata; i++ ) {
+	    dp = get_point ( i, &pt );
+	    if ( ! valid_point ( dp ) )
+		continue;
+	    if ( dp->lat < s ) s = dp->lat;
+	    if ( dp->lat > n ) n = dp->lat;
+	    if ( dp->lon < w ) w = dp->lon;
+	    if ( dp->lon > e ) e = dp->lon;
+	}
+	kd_lat0 = (s + n) / 2.0;
+	kd_lon0 = (w + e) / 2.0;
+
+	kd_pts = realloc ( kd_pts, (ndata + 1) * sizeof(struct kd_point) );
+	if ( ! kd_pts )
+	    oops ( "Out of memory for k-d tree" );
+
+	kd_npts = 0;
+	for ( i=0; i<ndata; i++ ) {
+	    dp = get_point ( i, &pt );
+	    if ( ! valid_point ( dp ) )
+		continue;
+	    kd_feet ( dp->lat, dp->lon, &kd_pts[kd_npts].x, &kd_pts[kd_npts].y );
+	    kd_pts[kd_npts].index = i;
+	    kd_npts++;
+	}
+
+	kd_split ( kd_pts, kd_npts, 0 );
+}
+
+/* Distances here are all squared, no need for sqrt until the end */
+void
+kd_near ( struct kd_point *pts, int n, int axis, double x, double y,
+	struct kd_point **best, double *best_d )
+{
+	struct kd_point *pp;
+	double d, dx, dy;
+	int mid;
+
+	while ( n > 0 ) {
+	    mid = n / 2;
+	    pp = &pts[mid];
+	    dx = pp->x - x;
+	    dy = pp->y - y;
+	    d = dx*dx + dy*dy;
+	    if ( d < *best_d ) {
+		*best_d = d;
+		*best = pp;
+	    }
+
+	    d = axis ? -dy : -dx;	/* query minus split */
+
+	    /* Look on our side first, the other side only if it could be closer */
+	    if ( d < 0 ) {
+		kd_near ( pts, mid, !axis, x, y, best, best_d );
+		if ( d*d >= *best_d )
+		    return;
+		pts += mid + 1;
+		n -= mid + 1;
+	    } else {
+		kd_near ( pts + mid + 1, n - mid - 1, !axis, x, y, best, best_d );
+		if ( d*d >= *best_d )
+		    return;
+		n = mid;
+	    }
+	    axis = !axis;
+	}
+}
+
+/* Index of the point nearest lat/long, or -1 if there are none */
+int
+kd_nearest ( double lat, double lon, double *feet )
+{
+	struct kd_point *best;
+	double best_d;
+	double x, y;
+
+	if ( kd_npts < 1 )
+	    return -1;
+
+	kd_feet ( lat, lon, &x, &y );
+	best = &kd_pts[kd_npts / 2];
+	best_d = HUGE_VAL;
+	kd_near ( kd_pts, kd_npts, 0, x, y, &best, &best_d );
+
+	if ( feet )
+	    *feet = sqrt ( best_d );
+	return best->index;
+}
+
+void
+kd_hit ( struct kd_point *pp, double d )
+{
+	if ( kd_nhits >= kd_maxhits ) {
+	    kd_maxhits = kd_maxhits ? kd_maxhits * 2 : 64;
+	    kd_hits = realloc ( kd_hits, kd_maxhits * sizeof(struct kd_hit) );
+	    if ( ! kd_hits )
+		oops ( "Out of memory for k-d hits" );
+	}
+	kd_hits[kd_nhits].index = pp->index;
+	kd_hits[kd_nhits].feet = sqrt ( d );
+	kd_nhits++;
+}
+
+void
+kd_range ( struct kd_point *pts, int n, int axis, double x, double y, double r2 )
+{
+	struct kd_point *pp;
+	double d, dx, dy;
+	int mid;
+
+	while ( n > 0 ) {
+	    mid = n / 2;
+	    pp = &pts[mid];
+	    dx = pp->x - x;
+	    dy = pp->y - y;
+	    d = dx*dx + dy*dy;
+	    if ( d <= r2 )
+		kd_hit ( pp, d );
+
+	    d = axis ? -dy : -dx;
+	    if ( d*d <= r2 ) {
+		/* The circle crosses the split, do both sides */
+		kd_range ( pts, mid, !axis, x, y, r2 );
+		pts += mid + 1;
+		n -= mid + 1;
+	    } else if ( d < 0 )
+		n = mid;
+	    else {
+		pts += mid + 1;
+		n -= mid + 1;
+	    }
+	    axis = !axis;
+	}
+}
+
+int
+kd_hit_cmp ( const void *a, const void *b )
+{
+	const struct kd_hit *ha = a;
+	const struct kd_hit *hb = b;
+
+	if ( ha->feet != hb->feet )
+	    return ha->feet < hb->feet ? -1 : 1;
+	return ha->index - hb->index;
+}
+
+/* Points within so many feet, nearest first, in kd_hits[] */
+int
+kd_within ( double lat, double lon, double feet )
+{
+	double x, y;
+
+	kd_nhits = 0;
+	kd_feet ( lat, lon, &x, &y );
+	kd_range ( kd_pts, kd_npts, 0, x, y, feet * feet );
+
+	qsort ( kd_hits, kd_nhits, sizeof(struct kd_hit), kd_hit_cmp );
+	return kd_nhits;
+}
+
+void
+near_cmd ( void )
+{
+	char line[256];
+	double lat, lon, feet;
+	int n, i;
+
+	read_file ();
+	kd_build ();
+
+	while ( fgets ( line, sizeof(line), stdin ) ) {
+	    n = sscanf ( line, "%lf %lf %lf", &lat, &lon, &feet );
+	    if ( n < 2 ) {
+		printf ( "0\n" );
+	    } else if ( n == 2 ) {
+		i = kd_nearest ( lat, lon, &feet );
+		if ( i < 0 )
+		    printf ( "0\n" );
+		else
+		    printf ( "1\n%d %.1f\n", i + 1, feet );
+	    } else {
+		n = kd_within ( lat, lon, feet );
+		printf ( "%d\n", n );
+		for ( i=0; i<n; i++ )
+		    printf ( "%d %.1f\n", kd_hits[i].index + 1, kd_hits[i].feet );
+	    }
+	    fflush ( stdout );
+	}
+}
+
+/* --------------------------------------------------------- */
+/* Batch reading --
+ *
+ * Indexing a few thousand 20-50k activity files one at a time
+ * (open, read, read, read, close) spends all its time waiting,
+ * especially when the files live on the NAS.
+ * So the reading gets done ahead of the decoding, by a loader
+ * that keeps lots of files on the way at once, and hands each
+ * one over (the whole file in memory) as soon as it arrives.
+ * The decoding threads take them in whatever order they show up.
+ *
+ * If the kernel has io_uring, one loader thread does it all with
+ * that: openat and statx go in together, then a read of the whole
+ * file, then a close, for up to BATCH_DEPTH files at a time.
+ * We talk to the kernel with plain syscalls (no liburing needed).
+ * If there is no io_uring (old kernel, or a sandbox that blocks it)
+ * we fall back to BATCH_THREADS threads doing open/fstat/pread.
+ *
+ * Either way there are never more than BATCH_DEPTH files read
+ * but not yet decoded, so memory stays bounded.
+ *
+ * batch_start ( paths, n ) gets it going,
+ * batch_next () hands out the next file that is ready (or -1),
+ * batch_release () is called when done with it, and
+ * batch_end () waits for the loaders to finish.
+ */
+
+#define BATCH_DEPTH	64	/* files read ahead */
+#define BATCH_THREADS	16	/* pread loaders, without io_uring */
+
+struct batch_file {
+	int file;
+	u8 *buf;
+	long len;		/* -errno if the read failed */
+};
+
+char **b_paths;
+int b_nfile;
+int b_next;			/* next file to start reading */
+int b_held;			/* read (or being read) but not released */
+int b_loaders;			/* loader threads still running */
+int b_uring;			/* using io_uring */
+
+/* One extra, so a full queue doesn't look empty */
+struct batch_file b_queue[BATCH_DEPTH+1];
+int b_qhead;
+int b_qtail;
+
+pthread_mutex_t b_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t b_ready = PTHREAD_COND_INITIALIZER;	/* something in the queue */
+pthread_cond_t b_room = PTHREAD_COND_INITIALIZER;	/* b_held went down */
+
+pthread_t b_tids[BATCH_THREADS];
+int b_ntid;
+
+/* Hand a file over to the decoders */
+void
+batch_put ( int file, u8 *buf, long len )
+{
+	pthread_mutex_lock ( &b_lock );
+	b_queue[b_qtail].file = file;
+	b_queue[b_qtail].buf = buf;
+	b_queue[b_qtail].len = len;
+	b_qtail = (b_qtail + 1) % (BATCH_DEPTH+1);
+	pthread_cond_signal ( &b_ready );
+	pthread_mutex_unlock ( &b_lock );
+}
+
+/* A loader is finished, wake everybody so they can see */
+void
+batch_loader_done ( void )
+{
+	pthread_mutex_lock ( &b_lock );
+	b_loaders--;
+	pthread_cond_broadcast ( &b_ready );
+	pthread_mutex_unlock ( &b_lock );
+}
+
+/* Next file to decode, or -1 when there are no more */
+int
+batch_next ( u8 **buf, long *len )
+{
+	struct batch_file *bp;
+	int file = -1;
+
+	pthread_mutex_lock ( &b_lock );
+	while ( b_qhead == b_qtail && b_loaders > 0 )
+	    pthread_cond_wait ( &b_ready, &b_lock );
+
+	if ( b_qhead != b_qtail ) {
+	    bp = &b_queue[b_qhead];
+	    b_qhead = (b_qhead + 1) % (BATCH_DEPTH+1);
+	    file = bp->file;
+	    *buf = bp->buf;
+	    *len = bp->len;
+	}
+	pthread_mutex_unlock ( &b_lock );
+
+	return file;
+}
+
+void
+batch_release ( u8 *buf )
+{
+	free ( buf );
+
+	pthread_mutex_lock ( &b_lock );
+	b_held--;
+	pthread_cond_broadcast ( &b_room );
+	pthread_mutex_unlock ( &b_lock );
+}
+
+/* Without io_uring --
+ * each thread grabs the next file (when there is room)
+ * and reads it the old fashioned way.
+ */
+void *
+batch_pread_worker ( void *arg )
+{
+	struct stat st;
+	u8 *buf;
+	long len, got;
+	int file, fd, n;
+
+	for ( ;; ) {
+	    pthread_mutex_lock ( &b_lock );
+	    while ( b_held >= BATCH_DEPTH && b_next < b_nfile )
+		pthread_cond_wait ( &b_room, &b_lock );
+	    file = b_next < b_nfile ? b_next++ : -1;
+	    if ( file >= 0 )
+		b_held++;
+	    pthread_mutex_unlock ( &b_lock );
+
+	    if ( file < 0 )
+		break;
+
+	    buf = NULL;
+	    fd = open ( b_paths[file], O_RDONLY );
+	    if ( fd < 0 || fstat ( fd, &st ) < 0 ) {
+		len = -1;
+	    } else {
+		len = st.st_size;
+		buf = malloc ( len ? len : 1 );
+		for ( got = 0; buf && got < len; got += n ) {
+		    n = pread ( fd, buf + got, len - got, got );
+		    if ( n <= 0 )
+			break;
+		}
+		if ( ! buf || got < len )
+		    len = -1;
+	    }
+	    if ( fd >= 0 )
+		close ( fd );
+
+	    batch_put ( file, buf, len );
+	}
+
+	batch_loader_done ();
+	return NULL;
+}
+
+/* With io_uring --
+ * The rings are shared with the kernel.  We put entries in the
+ * submission ring and move its tail, the kernel puts results
+ * in the completion ring and moves that tail.
+ * Each file in flight has a slot, and the slot number and what
+ * we asked for go in the user_data of each request.
+ */
+
+#define UR_OPEN		0
+#define UR_STATX	1
+#define UR_READ		2
+#define UR_CLOSE	3
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	int nsubmit;		/* queued but not yet told to the kernel */
+};
+
+struct uslot {
+	int file;		/* -1 if the slot is free */
+	int fd;
+	int pending;		/* requests not yet completed */
+	int err;
+	struct statx stx;
+	u8 *buf;
+	long len;
+	long got;
+};
+
+struct uring ur;
+
+int
+uring_enter ( int submit, int wait )
+{
+	return syscall ( __NR_io_uring_enter, ur.fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+}
+
+/* See if io_uring is there, and can do everything we want */
+int
+uring_setup ( void )
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	static int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+	u8 *sq, *cq;
+	int i, ok;
+
+	memset ( &p, 0, sizeof(p) );
+	ur.fd = syscall ( __NR_io_uring_setup, BATCH_DEPTH * 2, &p );
+	if ( ur.fd < 0 )
+	    return 0;
+
+	probe = calloc ( 1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op) );
+	ok = probe && syscall ( __NR_io_uring_register, ur.fd, IORING_REGISTER_PROBE, probe, 256 ) >= 0;
+	for ( i=0; ok && i<sizeof(ops)/sizeof(int); i++ )
+	    if ( ops[i] > probe->last_op || ! (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+		ok = 0;
+	free ( probe );
+
+	if ( ok ) {
+	    sq = mmap ( NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING );
+	    cq = mmap ( NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_CQ_RING );
+	    ur.sqes = mmap ( NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES );
+	    if ( sq == MAP_FAILED || cq == MAP_FAILED || ur.sqes == MAP_FAILED )
+		ok = 0;
+	}
+
+	if ( ! ok ) {
+	    close ( ur.fd );
+	    return 0;
+	}
+
+	ur.sq_head = (unsigned *) (sq + p.sq_off.head);
+	ur.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ur.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ur.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ur.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ur.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ur.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ur.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ur.nsubmit = 0;
+
+	/* We never unmap these, the process is done with them when it exits */
+	return 1;
+}
+
+/* Get an empty submission entry.
+ * The ring has room for two per slot, and no slot ever has
+ * more than two going at once, so this can't run out.
+ */
+struct io_uring_sqe *
+uring_sqe ( int op, int fd, void *addr, int len, long off )
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, i;
+
+	tail = *ur.sq_tail;
+	i = tail & *ur.sq_mask;
+	sqe = &ur.sqes[i];
+	memset ( sqe, 0, sizeof(*sqe) );
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = off;
+	ur.sq_array[i] = i;
+
+	/* The kernel must see the entry before it sees the tail move */
+	__atomic_store_n ( ur.sq_tail, tail + 1, __ATOMIC_RELEASE );
+	ur.nsubmit++;
+	return sqe;
+}
+
+void
+uring_read ( struct uslot *sp, int slot )
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe ( IORING_OP_READ, sp->fd, sp->buf + sp->got, sp->len - sp->got, sp->got );
+	sqe->user_data = slot*4 + UR_READ;
+	sp->pending = 1;
+}
+
+/* One completion came in, move that file along */
+void
+uring_done ( struct uslot *slots, struct io_uring_cqe *cqe )
+{
+	int slot = cqe->user_data / 4;
+	int what = cqe->user_data % 4;
+	struct uslot *sp = &slots[slot];
+	int res = cqe->res;
+
+	sp->pending--;
+	if ( res < 0 && what != UR_CLOSE )
+	    sp->err = res;
+
+	if ( what == UR_OPEN && res >= 0 )
+	    sp->fd = res;
+	if ( what == UR_READ && res > 0 )
+	    sp->got += res;
+	if ( what == UR_READ && res == 0 )
+	    sp->err = -EIO;		/* file got shorter on us */
+
+	if ( sp->pending )
+	    return;
+
+	if ( what == UR_CLOSE ) {
+	    sp->file = -1;
+	    return;
+	}
+
+	if ( what != UR_READ && ! sp->err ) {
+	    /* Both open and statx are back */
+	    sp->len = sp->stx.stx_size;
+	    sp->got = 0;
+	    sp->buf = malloc ( sp->len ? sp->len : 1 );
+	    if ( ! sp->buf )
+		sp->err = -ENOMEM;
+	    else if ( sp->len ) {
+		uring_read ( sp, slot );
+		return;
+	    }
+	}
+
+	if ( what == UR_READ && ! sp->err && sp->got < sp->len ) {
+	    uring_read ( sp, slot );
+	    return;
+	}
+
+	/* All read (or it went wrong), hand it over and close up */
+	if ( sp->err ) {
+	    free ( sp->buf );
+	    batch_put ( sp->file, NULL, sp->err );
+	} else
+	    batch_put ( sp->file, sp->buf, sp->len );
+
+	if ( sp->fd >= 0 ) {
+	    uring_sqe ( IORING_OP_CLOSE, sp->fd, NULL, 0, 0 ) -> user_data = slot*4 + UR_CLOSE;
+	    sp->pending = 1;
+	} else
+	    sp->file = -1;
+}
+
+void *
+batch_uring_worker ( void *arg )
+{
+	struct uslot slots[BATCH_DEPTH];
+	struct uslot *sp;
+	struct io_uring_sqe *sqe;
+	unsigned head;
+	int active = 0;
+	int i, n;
+
+	for ( i=0; i<BATCH_DEPTH; i++ )
+	    slots[i].file = -1;
+
+	for ( ;; ) {
+	    /* Start as many files as we have room for */
+	    pthread_mutex_lock ( &b_lock );
+	    for ( i=0; i<BATCH_DEPTH && b_next < b_nfile && b_held < BATCH_DEPTH; i++ ) {
+		sp = &slots[i];
+		if ( sp->file >= 0 )
+		    continue;
+		sp->file = b_next++;
+		b_held++;
+		sp->fd = -1;
+		sp->err = 0;
+		sp->buf = NULL;
+		sp->pending = 2;
+
+		sqe = uring_sqe ( IORING_OP_OPENAT, AT_FDCWD, b_paths[sp->file], 0, 0 );
+		sqe->open_flags = O_RDONLY;
+		sqe->user_data = i*4 + UR_OPEN;
+
+		sqe = uring_sqe ( IORING_OP_STATX, AT_FDCWD, b_paths[sp->file], STATX_SIZE, 0 );
+		sqe->off = (unsigned long) &sp->stx;
+		sqe->user_data = i*4 + UR_STATX;
+		active++;
+	    }
+
+	    if ( ! active ) {
+		/* Nothing going on, either all done or waiting for room */
+		if ( b_next >= b_nfile ) {
+		    pthread_mutex_unlock ( &b_lock );
+		    break;
+		}
+		pthread_cond_wait ( &b_room, &b_lock );
+		pthread_mutex_unlock ( &b_lock );
+		continue;
+	    }
+	    pthread_mutex_unlock ( &b_lock );
+
+	    /* Tell the kernel about new requests, and wait for at least one */
+	    n = uring_enter ( ur.nsubmit, 1 );
+	    if ( n < 0 && errno != EINTR )
+		oops ( "io_uring_enter failed" );
+	    if ( n > 0 )
+		ur.nsubmit -= n;
+
+	    head = *ur.cq_head;
+	    while ( head != __atomic_load_n ( ur.cq_tail, __ATOMIC_ACQUIRE ) ) {
+		uring_done ( slots, &ur.cqes[head & *ur.cq_mask] );
+		head++;
+		__atomic_store_n ( ur.cq_head, head, __ATOMIC_RELEASE );
+	    }
+
+	    for ( active = i = 0; i<BATCH_DEPTH; i++ )
+		if ( slots[i].file >= 0 )
+		    active++;
+	}
+
+	close ( ur.fd );
+	batch_loader_done ();
+	return NULL;
+}
+
+void
+batch_start ( char **paths, int n )
+{
+	int i;
+
+	b_paths = paths;
+	b_nfile = n;
+	b_next = b_held = 0;
+	b_qhead = b_qtail = 0;
+
+	b_uring = uring_setup ();
+	b_ntid = b_uring ? 1 : BATCH_THREADS;
+	b_loaders = b_ntid;
+
+	for ( i=0; i<b_ntid; i++ )
+	    if ( pthread_create ( &b_tids[i], NULL,
+		    b_uring ? batch_uring_worker : batch_pread_worker, NULL ) )
+		oops ( "Cannot create thread" );
+}
+
+void
+batch_end ( void )
+{
+	int i;
+
+	for ( i=0; i<b_ntid; i++ )
+	    pthread_join ( b_tids[i], NULL );
+}
+
+/* --------------------------------------------------------- */
+/* Spatial index --
+ *
+ * g66i is all about showing tracks on 7.5 minute quads.
+ * With thousands of FIT files around, finding the ones that
+ * touch a given quad means reading every one of them.
+ * So we build an index once (fit66 -i dir index) and then
+ * ask it questions (fit66 -w index lat long).
+ *
+ * Each file gets chopped into segments of up to SEG_POINTS
+ * points (or wherever there is a big time gap) and each segment
+ * gets a bounding box.  The segments are bucketed into 7.5 minute
+ * cells, one cell being exactly one USGS quad.  A query works out
+ * which cells it covers, and each row of cells is one binary search.
+ *
+ * Bounding boxes are in semicircles like the FIT file,
+ * rounded outward.  The index file is just these in a row:
+ *
+ *   struct idx_header
+ *   struct idx_file [nfile]
+ *   struct idx_seg [nseg]
+ *   struct idx_cell [ncell]	(sorted by key)
+ *   u32 ref [nref]		(segment numbers for the cells)
+ *   names			(null terminated paths)
+ */
+
+#define IDX_MAGIC	"F66X"
+#define IDX_VERSION	1
+
+#define SEG_POINTS	64
+#define SEG_GAP		600	/* seconds */
+
+#define QUADS_PER_DEG	8	/* 7.5 minutes */
+#define QUAD_ROWS	(180 * QUADS_PER_DEG)
+#define QUAD_COLS	(360 * QUADS_PER_DEG)
+
+struct bbox {
+	int s, w, n, e;		/* semicircles */
+};
+
+struct idx_header {
+	char magic[4];
+	u32 version;
+	u32 nfile;
+	u32 nseg;
+	u32 ncell;
+	u32 nref;
+	u32 names_size;
+};
+
+struct idx_file {
+	u32 name;		/* offset into names */
+	u32 seg;		/* first segment */
+	u32 nseg;
+	u32 npoints;
+	u32 t0, t1;
+	struct bbox bb;
+};
+
+struct idx_seg {
+	u32 file;
+	u32 point;		/* first point in the segment */
+	u32 npoints;
+	u32 t0, t1;
+	struct bbox bb;
+};
+
+struct idx_cell {
+	u32 key;
+	u32 ref;		/* first entry in ref[] */
+	u32 nref;
+};
+
+/* One of these for each file while we build */
+struct idx_work {
+	char *path;
+	int ok;
+	struct idx_file f;
+	struct idx_seg *seg;
+};
+
+struct idx_work *idx_work;
+int idx_nwork;
+
+/* -jN on the command line, 0 means one per cpu */
+int nthreads = 0;
+
+int
+deg2cc ( double deg )
+{
+	return (int) floor ( deg * 0x80000000 / 180.0 );
+}
+
+/* Records without a GPS fix have lat/long of 0x7fffffff.
+ * As a longitude that is a hair under 180 degrees,
+ * one semicircle more than any real longitude can be.
+ */
+int
+valid_point ( struct data *dp )
+{
+	return fabs ( dp->lat ) <= 90.0 && fabs ( dp->lon ) < 179.9999999;
+}
+
+void
+bbox_empty ( struct bbox *bp )
+{
+	bp->s = bp->w = 0x7fffffff;
+	bp->n = bp->e = -0x7fffffff;
+}
+
+void
+bbox_add ( struct bbox *bp, struct data *dp )
+{
+	int lat, lon;
+
+	lat = deg2cc ( dp->lat );
+	lon = deg2cc ( dp->lon );
+
+	if ( lat < bp->s ) bp->s = lat;
+	if ( lat + 1 > bp->n ) bp->n = lat + 1;
+	if ( lon < bp->w ) bp->w = lon;
+	if ( lon + 1 > bp->e ) bp->e = lon + 1;
+}
+
+void
+bbox_merge ( struct bbox *bp, struct bbox *xp )
+{
+	if ( xp->s < bp->s ) bp->s = xp->s;
+	if ( xp->n > bp->n ) bp->n = xp->n;
+	if ( xp->w < bp->w ) bp->w = xp->w;
+	if ( xp->e > bp->e ) bp->e = xp->e;
+}
+
+int
+bbox_hit ( struct bbox *a, struct bbox *b )
+{
+	return a->s <= b->n && b->s <= a->n && a->w <= b->e && b->w <= a->e;
+}
+
+int
+quad_row ( int lat )
+{
+	int row = (int) floor ( (cc2deg(lat) + 90.0) * QUADS_PER_DEG );
+
+	if ( row < 0 ) return 0;
+	if ( row >= QUAD_ROWS ) return QUAD_ROWS - 1;
+	return row;
+}
+
+int
+quad_col ( int lon )
+{
+	int col = (int) floor ( (cc2deg(lon) + 180.0) * QUADS_PER_DEG );
+
+	if ( col < 0 ) return 0;
+	if ( col >= QUAD_COLS ) return QUAD_COLS - 1;
+	return col;
+}
+
+/* Chop the points in data[] into segments.
+ * A segment includes the last point of the one before it
+ * (unless there was a gap) so the line between them is covered.
+ */
+void
+idx_segments ( struct idx_work *wp )
+{
+	struct idx_seg *sp = NULL;
+	struct data pt[2], *dp, *lp = NULL;
+	int nseg = 0;
+	int maxseg = 0;
+	int last = -1;
+	int i;
+
+	wp->f.npoints = ndata;
+	wp->f.t0 = ndata ? get_point ( 0, &pt[0] ) -> time : 0;
+	wp->f.t1 = ndata ? get_point ( ndata-1, &pt[0] ) -> time : 0;
+	bbox_empty ( &wp->f.bb );
+
+	for ( i=0; i<ndata; i++ ) {
+	    /* Alternate between the two so *lp stays good */
+	    dp = get_point ( i, &pt[ lp == &pt[0] ] );
+	    if ( ! valid_point ( dp ) )
+		continue;
+
+	    if ( ! sp || sp->npoints >= SEG_POINTS ||
+		    dp->time - lp->time > SEG_GAP ) {
+		if ( nseg >= maxseg ) {
+		    maxseg = maxseg ? maxseg * 2 : 16;
+		    wp->seg = realloc ( wp->seg, maxseg * sizeof(struct idx_seg) );
+		    if ( ! wp->seg )
+			oops ( "Out of memory for segments" );
+		}
+		sp = &wp->seg[nseg++];
+		sp->point = i;
+		sp->npoints = 0;
+		sp->t0 = dp->time;
+		bbox_empty ( &sp->bb );
+		if ( last >= 0 && dp->time - lp->time <= SEG_GAP )
+		    bbox_add ( &sp->bb, lp );
+	    }
+
+	    sp->npoints++;
+	    sp->t1 = dp->time;
+	    bbox_add ( &sp->bb, dp );
+	    bbox_add ( &wp->f.bb, dp );
+	    last = i;
+	    lp = dp;
+	}
+
+	wp->f.nseg = nseg;
+	wp->ok = 1;
+}
+
+void *
+idx_worker ( void *arg )
+{
+	struct arena arena;
+	jmp_buf jb;
+	u8 *buf;
+	long len;
+	int i;
+
+	/* Points for each file go in our arena, which gets
+	 * emptied (but kept) before the next one.
+	 */
+	memset ( &arena, 0, sizeof(arena) );
+	data_arena = &arena;
+
+	/* Files come from the batch reader, in whatever order they get read */
+	for ( ;; ) {
+	    i = batch_next ( &buf, &len );
+	    if ( i < 0 )
+		break;
+
+	    arena_reset ( &arena );
+	    data = NULL;
+	    qdata = NULL;
+	    max_data = 0;
+
+	    if ( setjmp ( jb ) ) {
+		fprintf ( stderr, "Skipping %s\n", idx_work[i].path );
+		in_mem = NULL;
+		batch_release ( buf );
+		continue;
+	    }
+	    oops_jmp = &jb;
+	    if ( len < 0 )
+		oops ( "Cannot read file" );
+
+	    in_mem = buf;
+	    in_mem_len = len;
+	    read_fit ( idx_work[i].path );
+	    in_mem = NULL;
+
+	    idx_segments ( &idx_work[i] );
+	    batch_release ( buf );
+	}
+
+	oops_jmp = NULL;
+	data_arena = NULL;
+	arena_free ( &arena );
+	data = NULL;
+	qdata = NULL;
+	max_data = 0;
+	free ( m_seg ); free ( m_cum ); free ( m_grade ); free ( m_vspeed ); free ( m_moving );
+	return NULL;
+}
+
+int
+get_nthreads ( void )
+{
+	int n = nthreads;
+
+	if ( n < 1 )
+	    n = sysconf ( _SC_NPROCESSORS_ONLN );
+	if ( n < 1 )
+	    n = 1;
+	return n;
+}
+
+/* Run fn on n worker threads and wait for them all */
+void
+run_threads ( void *(*fn)(void *), int n )
+{
+	pthread_t *tids;
+	int i;
+
+	tids = malloc ( n * sizeof(pthread_t) );
+	if ( ! tids )
+	    oops ( "Out of memory for threads" );
+
+	for ( i=0; i<n; i++ )
+	    if ( pthread_create ( &tids[i], NULL, fn, (void *) (long) i ) )
+		oops ( "Cannot create thread" );
+	for ( i=0; i<n; i++ )
+	    pthread_join ( tids[i], NULL );
+	free ( tids );
+}
+
+int
+is_fit_name ( char *name )
+{
+	int n = strlen ( name );
+
+	return n > 4 && strcasecmp ( &name[n-4], ".fit" ) == 0;
+}
+
+int
+name_cmp ( const void *a, const void *b )
+{
+	return strcmp ( *(char **) a, *(char **) b );
+}
+
+/* Make a sorted list of the FIT files in a directory */
+char **
+fit_dir ( char *dir, int *count )
+{
+	DIR *dp;
+	struct dirent *ep;
+	char **list = NULL;
+	int n = 0;
+	int max = 0;
+	char *path;
+
+	dp = opendir ( dir );
+	if ( ! dp ) {
+	    printf ( "Directory: %s\n", dir );
+	    oops ( "Cannot open directory" );
+	}
+
+	while ( (ep = readdir ( dp )) ) {
+	    if ( ! is_fit_name ( ep->d_name ) )
+		continue;
+	    if ( n >= max ) {
+		max = max ? max * 2 : 256;
+		list = realloc ( list, max * sizeof(char *) );
+		if ( ! list )
+		    oops ( "Out of memory for file list" );
+	    }
+	    path = malloc ( strlen(dir) + strlen(ep->d_name) + 2 );
+	    if ( ! path )
+		oops ( "Out of memory for file list" );
+	    sprintf ( path, "%s/%s", dir, ep->d_name );
+	    list[n++] = path;
+	}
+	closedir ( dp );
+
+	if ( n )
+	    qsort ( list, n, sizeof(char *), name_cmp );
+	*count = n;
+	return list;
+}
+
+/* A (key, segment) pair, one for each cell a segment touches */
+struct idx_pair {
+	u32 key;
+	u32 seg;
+};
+
+int
+pair_cmp ( const void *a, const void *b )
+{
+	const struct idx_pair *pa = a;
+	const struct idx_pair *pb = b;
+
+	if ( pa->key != pb->key )
+	    return pa->key < pb->key ? -1 : 1;
+	if ( pa->seg != pb->seg )
+	    return pa->seg < pb->seg ? -1 : 1;
+	return 0;
+}
+
+void
+xwrite ( FILE *fp, void *buf, int size, int count )
+{
+	if ( count && fwrite ( buf, size, count, fp ) != count )
+	    oops ( "Write error" );
+}
+
+void
+build_index ( char *dir, char *out )
+{
+	struct idx_header ih;
+	struct idx_work *wp;
+	struct idx_seg *sp;
+	struct idx_pair *pair = NULL;
+	struct idx_cell *cell;
+	u32 *ref;
+	char **names;
+	FILE *fp;
+	int npair = 0, maxpair = 0;
+	int nfile, nseg, ncell, names_size;
+	int r, c, r0, r1, c0, c1;
+	int i, j;
+
+	names = fit_dir ( dir, &idx_nwork );
+	idx_work = calloc ( idx_nwork ? idx_nwork : 1, sizeof(struct idx_work) );
+	if ( ! idx_work )
+	    oops ( "Out of memory for index" );
+	for ( i=0; i<idx_nwork; i++ )
+	    idx_work[i].path = names[i];
+
+	batch_start ( names, idx_nwork );
+	run_threads ( idx_worker, get_nthreads () );
+	batch_end ();
+
+	/* Number the segments and files, and make the cell pairs */
+	nfile = nseg = names_size = 0;
+	for ( i=0; i<idx_nwork; i++ ) {
+	    wp = &idx_work[i];
+	    if ( ! wp->ok )
+		continue;
+	    wp->f.name = names_size;
+	    names_size += strlen ( wp->path ) + 1;
+	    wp->f.seg = nseg;
+
+	    for ( j=0; j<wp->f.nseg; j++ ) {
+		sp = &wp->seg[j];
+		sp->file = nfile;
+		r0 = quad_row ( sp->bb.s );
+		r1 = quad_row ( sp->bb.n );
+		c0 = quad_col ( sp->bb.w );
+		c1 = quad_col ( sp->bb.e );
+		for ( r=r0; r<=r1; r++ )
+		    for ( c=c0; c<=c1; c++ ) {
+			if ( npair >= maxpair ) {
+			    maxpair = maxpair ? maxpair * 2 : 1024;
+			    pair = realloc ( pair, maxpair * sizeof(struct idx_pair) );
+			    if ( ! pair )
+				oops ( "Out of memory for index" );
+			}
+			pair[npair].key = r * QUAD_COLS + c;
+			pair[npair].seg = nseg + j;
+			npair++;
+		    }
+	    }
+	    nseg += wp->f.nseg;
+	    nfile++;
+	}
+
+	if ( npair )
+	    qsort ( pair, npair, sizeof(struct idx_pair), pair_cmp );
+
+	cell = malloc ( (npair ? npair : 1) * sizeof(struct idx_cell) );
+	ref = malloc ( (npair ? npair : 1) * sizeof(u32) );
+	if ( ! cell || ! ref )
+	    oops ( "Out of memory for index" );
+
+	ncell = 0;
+	for ( i=0; i<npair; i++ ) {
+	    if ( ! ncell || cell[ncell-1].key != pair[i].key ) {
+		cell[ncell].key = pair[i].key;
+		cell[ncell].ref = i;
+		cell[ncell].nref = 0;
+		ncell++;
+	    }
+	    cell[ncell-1].nref++;
+	    ref[i] = pair[i].seg;
+	}
+
+	fp = fopen ( out, "w" );
+	if ( ! fp )
+	    oops ( "Cannot open output index file" );
+
+	memcpy ( ih.magic, IDX_MAGIC, 4 );
+	ih.version = IDX_VERSION;
+	ih.nfile = nfile;
+	ih.nseg = nseg;
+	ih.ncell = ncell;
+	ih.nref = npair;
+	ih.names_size = names_size;
+	xwrite ( fp, &ih, sizeof(ih), 1 );
+
+	for ( i=0; i<idx_nwork; i++ )
+	    if ( idx_work[i].ok )
+		xwrite ( fp, &idx_work[i].f, sizeof(struct idx_file), 1 );
+	for ( i=0; i<idx_nwork; i++ )
+	    if ( idx_work[i].ok )
+		xwrite ( fp, idx_work[i].seg, sizeof(struct idx_seg), idx_work[i].f.nseg );
+	xwrite ( fp, cell, sizeof(struct idx_cell), ncell );
+	xwrite ( fp, ref, sizeof(u32), npair );
+	for ( i=0; i<idx_nwork; i++ )
+	    if ( idx_work[i].ok )
+		xwrite ( fp, idx_work[i].path, 1, strlen(idx_work[i].path) + 1 );
+
+	if ( fclose ( fp ) )
+	    oops ( "Write error" );
+
+	printf ( "Indexed %d of %d files: %d segments in %d quads\n",
+	    nfile, idx_nwork, nseg, ncell );
+
+	for ( i=0; i<idx_nwork; i++ ) {
+	    free ( idx_work[i].seg );
+	    free ( idx_work[i].path );
+	}
+	free ( idx_work );
+	free ( names );
+	free ( pair );
+	free ( cell );
+	free ( ref );
+}
+
+/* The query side.
+ * The index gets mapped into memory and used as is.
+ */
+
+struct index {
+	struct idx_header *ih;
+	struct idx_file *file;
+	struct idx_seg *seg;
+	struct idx_cell *cell;
+	u32 *ref;
+	char *names;
+};
+
+void
+load_index ( char *path, struct index *ip )
+{
+	struct stat st;
+	struct idx_header *ih;
+	char *base;
+	long need;
+	int fd;
+
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 ) {
+	    printf ( "Index file: %s\n", path );
+	    oops ( "Cannot open index file" );
+	}
+	if ( fstat ( fd, &st ) < 0 || st.st_size < sizeof(struct idx_header) )
+	    oops ( "Index file is too short" );
+
+	base = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close ( fd );
+	if ( base == MAP_FAILED )
+	    oops ( "Cannot map index file" );
+
+	ih = (struct idx_header *) base;
+	if ( strncmp ( ih->magic, IDX_MAGIC, 4 ) != 0 || ih->version != IDX_VERSION )
+	    oops ( "Not a fit66 index file" );
+
+	need = sizeof(struct idx_header) +
+	    (long) ih->nfile * sizeof(struct idx_file) +
+	    (long) ih->nseg * sizeof(struct idx_seg) +
+	    (long) ih->ncell * sizeof(struct idx_cell) +
+	    (long) ih->nref * sizeof(u32) + ih->names_size;
+	if ( need != st.st_size )
+	    oops ( "Index file is damaged" );
+
+	ip->ih = ih;
+	ip->file = (struct idx_file *) (ih + 1);
+	ip->seg = (struct idx_seg *) (ip->file + ih->nfile);
+	ip->cell = (struct idx_cell *) (ip->seg + ih->nseg);
+	ip->ref = (u32 *) (ip->cell + ih->ncell);
+	ip->names = (char *) (ip->ref + ih->nref);
+}
+
+/* First cell with key >= key */
+int
+cell_search ( struct index *ip, u32 key )
+{
+	int lo = 0;
+	int hi = ip->ih->ncell;
+	int mid;
+
+	while ( lo < hi ) {
+	    mid = (lo + hi) / 2;
+	    if ( ip->cell[mid].key < key )
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return lo;
+}
+
+int
+u32_cmp ( const void *a, const void *b )
+{
+	u32 ua = *(u32 *) a;
+	u32 ub = *(u32 *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+void
+show_hit ( struct index *ip, struct idx_seg *first, struct idx_seg *last )
+{
+	printf ( "%s", &ip->names[ip->file[first->file].name] );
+	printf ( " -- %s", tstamp ( first->t0 ) );
+	printf ( " to %s", tstamp ( last->t1 ) );
+	printf ( " -- points %d to %d\n", first->point + 1, last->point + last->npoints );
+}
+
+/* Find everything that touches the box */
+void
+query_index ( char *path, struct bbox *qb )
+{
+	struct index ix;
+	struct idx_seg *sp, *first, *last;
+	struct idx_cell *cp;
+	u32 *hits = NULL;
+	int nhit = 0, maxhit = 0;
+	int r, r0, r1, c0, c1;
+	int i, k;
+
+	load_index ( path, &ix );
+
+	r0 = quad_row ( qb->s );
+	r1 = quad_row ( qb->n );
+	c0 = quad_col ( qb->w );
+	c1 = quad_col ( qb->e );
+
+	for ( r=r0; r<=r1; r++ ) {
+	    k = cell_search ( &ix, r * QUAD_COLS + c0 );
+	    for ( ; k < ix.ih->ncell && ix.cell[k].key <= r * QUAD_COLS + c1; k++ ) {
+		cp = &ix.cell[k];
+		for ( i=0; i<cp->nref; i++ ) {
+		    if ( nhit >= maxhit ) {
+			maxhit = maxhit ? maxhit * 2 : 256;
+			hits = realloc ( hits, maxhit * sizeof(u32) );
+			if ( ! hits )
+			    oops ( "Out of memory for query" );
+		    }
+		    hits[nhit++] = ix.ref[cp->ref + i];
+		}
+	    }
+	}
+
+	if ( nhit )
+	    qsort ( hits, nhit, sizeof(u32), u32_cmp );
+
+	/* Segments are in file and time order, so runs of
+	 * neighboring segments turn into one time range.
+	 */
+	first = last = NULL;
+	for ( i=0; i<nhit; i++ ) {
+	    if ( i && hits[i] == hits[i-1] )
+		continue;
+	    sp = &ix.seg[hits[i]];
+	    if ( ! bbox_hit ( &sp->bb, qb ) )
+		continue;
+	    if ( last && last + 1 == sp && last->file == sp->file ) {
+		last = sp;
+		continue;
+	    }
+	    if ( first )
+		show_hit ( &ix, first, last );
+	    first = last = sp;
+	}
+	if ( first )
+	    show_hit ( &ix, first, last );
+
+	free ( hits );
+}
+
+/* fit66 -w index lat long -- the 7.5 minute quad holding this point
+ * fit66 -w index lat long lat long -- any box
+ */
+void
+query_cmd ( char *path, char **args, int nargs )
+{
+	struct bbox qb;
+	double lat1, lon1, lat2, lon2;
+
+	lat1 = atof ( args[0] );
+	lon1 = atof ( args[1] );
+
+	/* A quad doesn't include its north and east edges */
+	if ( nargs == 2 ) {
+	    lat1 = floor ( lat1 * QUADS_PER_DEG ) / QUADS_PER_DEG;
+	    lon1 = floor ( lon1 * QUADS_PER_DEG ) / QUADS_PER_DEG;
+	    qb.s = deg2cc ( lat1 );
+	    qb.w = deg2cc ( lon1 );
+	    qb.n = deg2cc ( lat1 + 1.0 / QUADS_PER_DEG ) - 1;
+	    qb.e = deg2cc ( lon1 + 1.0 / QUADS_PER_DEG ) - 1;
+	} else {
+	    lat2 = atof ( args[2] );
+	    lon2 = atof ( args[3] );
+	    qb.s = deg2cc ( lat1 < lat2 ? lat1 : lat2 );
+	    qb.n = deg2cc ( lat1 < lat2 ? lat2 : lat1 ) + 1;
+	    qb.w = deg2cc ( lon1 < lon2 ? lon1 : lon2 );
+	    qb.e = deg2cc ( lon1 < lon2 ? lon2 : lon1 ) + 1;
+	}
+
+	query_index ( path, &qb );
+}
+
+/* --------------------------------------------------------- */
+/* Heatmap --
+ *
+ * fit66 --heatmap dir out.pgm lat long [lat long]
+ *
+ * draws every track in dir into one big grid of counts, for
+ * the map layer that shows where I have been the most.
+ * One lat/long gives the 7.5 minute quad it falls in, two give
+ * a box, which gets pushed out to whole quads so the tiles line
+ * up with gtopo.  Each quad is HEAT_RES pixels on a side, or
+ * whatever --res=N says.
+ *
+ * Files get read by the batch reader and decoded by worker threads
+ * just like for the index, except that the points never get stored.
+ * heat_point is the point sink, and it draws a line from the last
+ * point to this one (unless there is a time gap) into that thread's
+ * own grid, so nobody has to lock anything.
+ * A pixel gets counted once per line through it (line ends don't
+ * get counted twice).  At the end the grids get added up.
+ *
+ * Output is a 16 bit PGM (counts over 65535 just stay there),
+ * or raw 16 bit little endian if the name ends in .raw.
+ * North is at the top.
+ */
+
+#define HEAT_RES	512		/* pixels per quad side */
+#define HEAT_MAX_PIX	(16*1024*1024)	/* per grid (each thread has one) */
+
+int heat_res = HEAT_RES;
+
+double h_north;
+double h_west;
+double h_ppd;			/* pixels per degree */
+int h_width;
+int h_height;
+
+u32 **h_grids;			/* one per thread */
+
+__thread u32 *h_grid;
+__thread double h_px, h_py;	/* last point, in pixels */
+__thread u32 h_time;
+__thread int h_have;
+
+/* Liang-Barsky: trim a line to the grid, 0 if none of it is left */
+int
+heat_clip ( double *x0, double *y0, double *x1, double *y1 )
+{
+	double p[4], q[4];
+	double t0 = 0.0, t1 = 1.0, r;
+	double dx = *x1 - *x0;
+	double dy = *y1 - *y0;
+	double xmax = h_width - 1e-6;
+	double ymax = h_height - 1e-6;
+	int i;
+
+	p[0] = -dx;	q[0] = *x0;
+	p[1] = dx;	q[1] = xmax - *x0;
+	p[2] = -dy;	q[2] = *y0;
+	p[3] = dy;	q[3] = ymax - *y0;
+
+	for ( i=0; i<4; i++ ) {
+	    if ( p[i] == 0.0 ) {
+		if ( q[i] < 0.0 )
+		    return 0;
+		continue;
+	    }
+	    r = q[i] / p[i];
+	    if ( p[i] < 0.0 ) {
+		if ( r > t1 )
+		    return 0;
+		if ( r > t0 )
+		    t0 = r;
+	    } else {
+		if ( r < t0 )
+		    return 0;
+		if ( r < t1 )
+		    t1 = r;
+	    }
+	}
+
+	*x1 = *x0 + t1 * dx;
+	*y1 = *y0 + t1 * dy;
+	*x0 = *x0 + t0 * dx;
+	*y0 = *y0 + t0 * dy;
+	return 1;
+}
+
+/* Count the pixels along a line, leaving out the first one
+ * if the line before this one already got it.
+ */
+void
+heat_line ( double x0, double y0, double x1, double y1, int first )
+{
+	double cx0 = x0, cy0 = y0;
+	double dx, dy;
+	int n, k;
+	int x, y, lx = -1, ly = -1;
+
+	if ( ! heat_clip ( &x0, &y0, &x1, &y1 ) )
+	    return;
+
+	/* If the start got clipped, nobody counted it */
+	if ( x0 != cx0 || y0 != cy0 )
+	    first = 1;
+
+	dx = x1 - x0;
+	dy = y1 - y0;
+	n = (int) ceil ( fabs ( dx ) > fabs ( dy ) ? fabs ( dx ) : fabs ( dy ) );
+	if ( n < 1 )
+	    n = 1;
+
+	if ( ! first ) {
+	    lx = (int) x0;
+	    ly = (int) y0;
+	}
+
+	for ( k = 0; k <= n; k++ ) {
+	    x = (int) (x0 + dx * k / n);
+	    y = (int) (y0 + dy * k / n);
+	    if ( x == lx && y == ly )
+		continue;
+	    h_grid[y * h_width + x]++;
+	    lx = x;
+	    ly = y;
+	}
+}
+
+void
+heat_point ( struct data *dp )
+{
+	double x, y;
+
+	if ( ! valid_point ( dp ) )
+	    return;
+
+	x = (dp->lon - h_west) * h_ppd;
+	y = (h_north - dp->lat) * h_ppd;
+
+	if ( h_have && dp->time - h_time <= SEG_GAP )
+	    heat_line ( h_px, h_py, x, y, 0 );
+	else
+	    heat_line ( x, y, x, y, 1 );
+
+	h_px = x;
+	h_py = y;
+	h_time = dp->time;
+	h_have = 1;
+}
+
+void *
+heat_worker ( void *arg )
+{
+	long me = (long) arg;
+	jmp_buf jb;
+	u8 *buf;
+	long len;
+	int i;
+
+	h_grid = calloc ( (long) h_width * h_height, sizeof(u32) );
+	if ( ! h_grid )
+	    oops ( "Out of memory for heatmap" );
+	h_grids[me] = h_grid;
+
+	for ( ;; ) {
+	    i = batch_next ( &buf, &len );
+	    if ( i < 0 )
+		break;
+
+	    if ( setjmp ( jb ) ) {
+		fprintf ( stderr, "Skipping %s\n", b_paths[i] );
+		in_mem = NULL;
+		batch_release ( buf );
+		continue;
+	    }
+	    oops_jmp = &jb;
+	    if ( len < 0 )
+		oops ( "Cannot read file" );
+
+	    h_have = 0;
+	    in_mem = buf;
+	    in_mem_len = len;
+	    read_fit ( b_paths[i] );
+	    in_mem = NULL;
+
+	    batch_release ( buf );
+	}
+
+	oops_jmp = NULL;
+	return NULL;
+}
+
+void
+heat_write ( char *path, u32 *grid )
+{
+	u8 *row;
+	u32 v;
+	FILE *fp;
+	int raw;
+	int n;
+	int x, y;
+
+	n = strlen ( path );
+	raw = n > 4 && strcmp ( &path[n-4], ".raw" ) == 0;
+
+	fp = fopen ( path, "w" );
+	if ( ! fp )
+	    oops ( "Cannot open heatmap output file" );
+	if ( ! raw )
+	    fprintf ( fp, "P5\n%d %d\n65535\n", h_width, h_height );
+
+	row = malloc ( h_width * 2 );
+	if ( ! row )
+	    oops ( "Out of memory for heatmap" );
+
+	for ( y=0; y<h_height; y++ ) {
+	    for ( x=0; x<h_width; x++ ) {
+		v = grid[y * h_width + x];
+		if ( v > 65535 )
+		    v = 65535;
+		/* PGM wants the high byte first */
+		row[2*x] = raw ? v & 0xff : v >> 8;
+		row[2*x+1] = raw ? v >> 8 : v & 0xff;
+	    }
+	    xwrite ( fp, row, 2, h_width );
+	}
+
+	if ( fclose ( fp ) )
+	    oops ( "Write error" );
+	free ( row );
+}
+
+void
+heatmap ( char *dir, char *out, char **args, int nargs )
+{
+	double lat1, lon1, lat2, lon2;
+	double s, n, w, e;
+	char **names;
+	long i, npix;
+	u32 *total, max;
+	int nfile, nt, t;
+
+	lat1 = atof ( args[0] );
+	lon1 = atof ( args[1] );
+	lat2 = nargs > 2 ? atof ( args[2] ) : lat1;
+	lon2 = nargs > 2 ? atof ( args[3] ) : lon1;
+
+	/* Out to whole quads */
+	s = floor ( (lat1 < lat2 ? lat1 : lat2) * QUADS_PER_DEG );
+	n = floor ( (lat1 < lat2 ? lat2 : lat1) * QUADS_PER_DEG ) + 1;
+	w = floor ( (lon1 < lon2 ? lon1 : lon2) * QUADS_PER_DEG );
+	e = floor ( (lon1 < lon2 ? lon2 : lon1) * QUADS_PER_DEG ) + 1;
+
+	h_north = n / QUADS_PER_DEG;
+	h_west = w / QUADS_PER_DEG;
+	h_ppd = heat_res * QUADS_PER_DEG;
+	h_width = (e - w) * heat_res;
+	h_height = (n - s) * heat_res;
+
+	npix = (long) h_width * h_height;
+	if ( npix > HEAT_MAX_PIX )
+	    oops ( "Heatmap too big, try a smaller box or --res" );
+
+	names = fit_dir ( dir, &nfile );
+	nt = get_nthreads ();
+	h_grids = calloc ( nt, sizeof(u32 *) );
+	if ( ! h_grids )
+	    oops ( "Out of memory for heatmap" );
+
+	/* All we need is where */
+	dec_mask = C_LAT | C_LON;
+	point_sink = heat_point;
+	batch_start ( names, nfile );
+	run_threads ( heat_worker, nt );
+	batch_end ();
+
+	/* Everybody's counts go into the first grid */
+	total = h_grids[0];
+	for ( t=1; t<nt; t++ ) {
+	    for ( i=0; i<npix; i++ )
+		total[i] += h_grids[t][i];
+	    free ( h_grids[t] );
+	}
+
+	max = 0;
+	for ( i=0; i<npix; i++ )
+	    if ( total[i] > max )
+		max = total[i];
+
+	heat_write ( out, total );
+
+	printf ( "Heatmap %dx%d (%.0fx%.0f quads from %.3f %.3f), %d files, busiest pixel %u\n",
+	    h_width, h_height, e - w, n - s, h_north, h_west, nfile, max );
+
+	free ( total );
+	free ( h_grids );
+	for ( i=0; i<nfile; i++ )
+	    free ( names[i] );
+	free ( names );
+}
+
+/* --------------------------------------------------------- */
+/* Duplicates --
+ *
+ * fit66 --dups dir
+ *
+ * The archive has grown copies of things over the years.  The same
+ * ride pulled off the device twice, a trimmed copy sitting next to
+ * the original, two devices on the same ride.  This finds them.
+ *
+ * Each file gets a cheap fingerprint on a worker thread (the batch
+ * reader feeds them, just like for the index):
+ *  - first and last record time, and how many records.
+ *  - the CRC of all the record message bytes strung together.
+ *    crc_block() just carries on from the CRC so far, so we get
+ *    the CRC of the stream without ever building it.  (I tried a
+ *    CRC per record stitched on with crc_combine(), and that was
+ *    ten times slower than reading the files.)
+ *  - the same thing for each DUP_WINDOW seconds of time, lined up
+ *    on absolute time, so a trimmed copy has the very same windows
+ *    as the original, except the partial ones at its ends.
+ *
+ * Then one pass over the files sorted by start time:
+ *  - same times, same count and same stream CRC is a duplicate.
+ *  - inside the time of another file, with every whole window of
+ *    it matching that file, is a subset (what -t or -s leaves).
+ *    Not much to go on if there are no whole windows, so a file
+ *    that short only gets called an overlap.
+ *  - anything else that shares time is an overlap.
+ * Once a file is a duplicate or a subset we say no more about it,
+ * otherwise all the pieces of one ride overlap each other.
+ *
+ * Only the record bytes count, so a copy with a different file ID
+ * or extra messages still shows up.  A -z copy does not (its records
+ * are different bytes), but it does show up as an overlap.
+ * These are 16 bit CRCs, so a duplicate is "almost surely" and I
+ * would look before deleting anything.
+ */
+
+#define DUP_WINDOW	60
+
+struct dup_win {
+	u32 slot;		/* time / DUP_WINDOW */
+	u16 crc;
+	u16 nrec;
+};
+
+struct dup_file {
+	char *path;
+	u32 t0, t1;
+	int nrec;
+	long bytes;		/* record bytes */
+	u16 crc;		/* CRC of all the record bytes */
+	int nwin;
+	struct dup_win *win;
+	int dup;		/* same as an earlier one */
+	int sub;		/* a piece of some other one */
+};
+
+struct dup_file *dups;
+
+void
+dup_finger ( struct dup_file *fp, u8 *buf, long len )
+{
+	struct cursor c;
+	struct dup_win *wp;
+	int nalloc = 0;
+	u8 *msg;
+	int size;
+	u32 slot;
+
+	cursor_open ( &c, buf, len );
+
+	wp = NULL;
+	while ( cursor_next ( &c ) ) {
+	    if ( c.dp->gid != GID_RECORD )
+		continue;
+
+	    msg = c.msg + 1;
+	    size = c.dp->size;
+
+	    if ( fp->nrec == 0 )
+		fp->t0 = c.ts;
+	    fp->t1 = c.ts;
+	    fp->nrec++;
+	    fp->crc = crc_block ( fp->crc, msg, size );
+	    fp->bytes += size;
+
+	    slot = c.ts / DUP_WINDOW;
+	    if ( ! wp || wp->slot != slot ) {
+		if ( fp->nwin == nalloc ) {
+		    nalloc = nalloc ? nalloc * 2 : 64;
+		    fp->win = realloc ( fp->win, nalloc * sizeof(struct dup_win) );
+		    if ( ! fp->win )
+			oops ( "Out of memory for duplicates" );
+		}
+		wp = &fp->win[fp->nwin++];
+		wp->slot = slot;
+		wp->crc = 0;
+		wp->nrec = 0;
+	    }
+	    wp->crc = crc_block ( wp->crc, msg, size );
+	    wp->nrec++;
+	}
+}
+
+void *
+dup_worker ( void *arg )
+{
+	struct dup_file *fp;
+	jmp_buf jb;
+	u8 *buf;
+	long len;
+	int i;
+
+	for ( ;; ) {
+	    i = batch_next ( &buf, &len );
+	    if ( i < 0 )
+		break;
+	    fp = &dups[i];
+
+	    if ( setjmp ( jb ) ) {
+		fprintf ( stderr, "Skipping %s\n", b_paths[i] );
+		free ( fp->win );
+		fp->win = NULL;
+		fp->nwin = 0;
+		fp->nrec = 0;
+		batch_release ( buf );
+		continue;
+	    }
+	    oops_jmp = &jb;
+	    if ( len < 0 )
+		oops ( "Cannot read file" );
+
+	    dup_finger ( fp, buf, len );
+	    batch_release ( buf );
+	}
+
+	oops_jmp = NULL;
+	return NULL;
+}
+
+int
+dup_cmp ( const void *a, const void *b )
+{
+	const struct dup_file *fa = a;
+	const struct dup_file *fb = b;
+
+	if ( fa->t0 != fb->t0 )
+	    return fa->t0 < fb->t0 ? -1 : 1;
+	/* longest first, so a subset comes after what it is in */
+	if ( fa->t1 != fb->t1 )
+	    return fa->t1 > fb->t1 ? -1 : 1;
+	if ( fa->nrec != fb->nrec )
+	    return fa->nrec > fb->nrec ? -1 : 1;
+	if ( fa->crc != fb->crc )
+	    return fa->crc < fb->crc ? -1 : 1;
+	return strcmp ( fa->path, fb->path );
+}
+
+int
+dup_same ( struct dup_file *a, struct dup_file *b )
+{
+	return a->t0 == b->t0 && a->t1 == b->t1 && a->nrec == b->nrec &&
+	    a->bytes == b->bytes && a->crc == b->crc;
+}
+
+/* Is b a piece of a?  Every whole window of b has to be the same
+ * as that window in a.  The first and last windows of b are partial
+ * (or may be), so we skip them.
+ */
+int
+dup_subset ( struct dup_file *a, struct dup_file *b )
+{
+	int i, j;
+
+	if ( b->t0 < a->t0 || b->t1 > a->t1 || b->nrec > a->nrec )
+	    return 0;
+	if ( b->nwin < 3 )
+	    return 0;
+
+	j = 0;
+	for ( i=1; i<b->nwin-1; i++ ) {
+	    while ( j < a->nwin && a->win[j].slot < b->win[i].slot )
+		j++;
+	    if ( j == a->nwin || a->win[j].slot != b->win[i].slot )
+		return 0;
+	    if ( a->win[j].crc != b->win[i].crc || a->win[j].nrec != b->win[i].nrec )
+		return 0;
+	}
+	return 1;
+}
+
+void
+find_dups ( char *dir )
+{
+	struct dup_file *a, *b;
+	char **names;
+	int nfile, n;
+	int i, j;
+	int ndup, nsub, nover;
+
+	names = fit_dir ( dir, &nfile );
+
+	dups = calloc ( nfile ? nfile : 1, sizeof(struct dup_file) );
+	if ( ! dups )
+	    oops ( "Out of memory for duplicates" );
+	for ( i=0; i<nfile; i++ )
+	    dups[i].path = names[i];
+
+	batch_start ( names, nfile );
+	run_threads ( dup_worker, get_nthreads () );
+	batch_end ();
+
+	/* Files with no records have nothing to say */
+	n = 0;
+	for ( i=0; i<nfile; i++ ) {
+	    if ( dups[i].nrec )
+		dups[n++] = dups[i];
+	    else {
+		free ( dups[i].win );
+		free ( dups[i].path );
+	    }
+	}
+
+	qsort ( dups, n, sizeof(struct dup_file), dup_cmp );
+
+	/* Duplicates sort next to each other */
+	ndup = 0;
+	for ( i=0; i<n; i++ ) {
+	    if ( dups[i].dup )
+		continue;
+	    for ( j=i+1; j<n && dup_same ( &dups[i], &dups[j] ); j++ ) {
+		if ( j == i+1 ) {
+		    printf ( "Duplicate: %s", dups[i].path );
+		    ndup++;
+		}
+		printf ( " %s", dups[j].path );
+		dups[j].dup = 1;
+	    }
+	    if ( j > i+1 )
+		printf ( "\n" );
+	}
+
+	/* Now anything that starts before this one ends.
+	 * A file always sorts after anything it is a piece of.
+	 */
+	nsub = 0;
+	for ( i=0; i<n; i++ ) {
+	    a = &dups[i];
+	    if ( a->dup || a->sub )
+		continue;
+	    for ( j=i+1; j<n && dups[j].t0 <= a->t1; j++ ) {
+		b = &dups[j];
+		if ( b->dup || b->sub || ! dup_subset ( a, b ) )
+		    continue;
+		printf ( "Subset: %s is in %s (%d of %d records)\n",
+		    b->path, a->path, b->nrec, a->nrec );
+		b->sub = 1;
+		nsub++;
+	    }
+	}
+
+	nover = 0;
+	for ( i=0; i<n; i++ ) {
+	    a = &dups[i];
+	    if ( a->dup || a->sub )
+		continue;
+	    for ( j=i+1; j<n && dups[j].t0 <= a->t1; j++ ) {
+		b = &dups[j];
+		if ( b->dup || b->sub )
+		    continue;
+		printf ( "Overlap: %s %s (%u seconds)\n", a->path, b->path,
+		    (b->t1 < a->t1 ? b->t1 : a->t1) - b->t0 );
+		nover++;
+	    }
+	}
+
+	printf ( "%d files, %d duplicate sets, %d subsets, %d overlaps\n",
+	    n, ndup, nsub, nover );
+
+	for ( i=0; i<n; i++ ) {
+	    free ( dups[i].win );
+	    free ( dups[i].path );
+	}
+	free ( dups );
+	free ( names );
+}
+
+/* --------------------------------------------------------- */
+/* Parallel CRC --
+ *
+ * Checking the CRC means feeding every byte of the file through
+ * one after the other, so a big file is stuck at the speed of one cpu.
+ * But with crc_combine() we can cut the file into chunks, do each
+ * chunk on its own thread, and stitch the answers together.
+ * The answer is exactly what calc_crc() would give.
+ * Small files (under CRC_CHUNK per thread) just get done in line.
+ */
+
+#define CRC_CHUNK	(1024*1024)
+
+__thread int crc_threads;
+
+struct crc_job {
+	u8 *buf;
+	long len;
+	u16 crc;
+};
+
+void *
+crc_worker ( void *arg )
+{
+	struct crc_job *jp = arg;
+
+	jp->crc = crc_block ( 0, jp->buf, jp->len );
+	return NULL;
+}
+
+u16
+par_crc ( u8 *buf, long len )
+{
+	struct crc_job *job;
+	pthread_t *tids;
+	long chunk;
+	u16 crc;
+	int nt;
+	int i;
+
+	nt = get_nthreads ();
+	if ( nt > len / CRC_CHUNK )
+	    nt = len / CRC_CHUNK;
+	if ( nt <= 1 ) {
+	    crc_threads = 1;
+	    return crc_block ( 0, buf, len );
+	}
+	crc_threads = nt;
+
+	job = calloc ( nt, sizeof(struct crc_job) );
+	tids = calloc ( nt, sizeof(pthread_t) );
+	if ( ! job || ! tids )
+	    oops ( "Out of memory for CRC" );
+
+	chunk = (len + nt - 1) / nt;
+	for ( i=0; i<nt; i++ ) {
+	    job[i].buf = buf + i * chunk;
+	    job[i].len = i == nt-1 ? len - i * chunk : chunk;
+	    if ( pthread_create ( &tids[i], NULL, crc_worker, &job[i] ) )
+		oops ( "Cannot create thread" );
+	}
+
+	crc = 0;
+	for ( i=0; i<nt; i++ ) {
+	    pthread_join ( tids[i], NULL );
+	    crc = crc_combine ( crc, job[i].crc, job[i].len );
+	}
+
+	free ( job );
+	free ( tids );
+	return crc;
+}
+
+/* Map a file into memory if we can, read it if we must */
+u8 *
+map_file ( char *path, long *len )
+{
+	struct stat st;
+	u8 *buf;
+	int fd;
+	int n;
+
+	if ( strcmp ( path, "-" ) != 0 ) {
+	    fd = open ( path, O_RDONLY );
+	    if ( fd < 0 ) {
+		printf ( "Input FIT file: %s\n", path );
+		oops ( "Cannot open input FIT file" );
+	    }
+	    if ( fstat ( fd, &st ) == 0 && S_ISREG ( st.st_mode ) && st.st_size > 0 ) {
+		buf = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close ( fd );
+		if ( buf == MAP_FAILED )
+		    oops ( "Cannot map input FIT file" );
+		*len = st.st_size;
+		return buf;
+	    }
+	    close ( fd );
+	}
+
+	buf = load_file ( path, &n );
+	*len = n;
+	return buf;
+}
+
+/* fit66 -C path */
+void
+crc_file ( char *path )
+{
+	struct fit_header fh;
+	u8 *buf;
+	long len;
+	long n;
+	u16 crc;
+
+	buf = map_file ( path, &len );
+
+	if ( len < 12 )
+	    oops ( "Not a FIT file" );
+	memcpy ( &fh, buf, len < sizeof(fh) ? 12 : sizeof(fh) );
+	if ( strncmp ( fh.sig, ".FIT", 4 ) != 0 )
+	    oops ( "Not a FIT file" );
+
+	/* The CRC covers the header and records, then the CRC itself */
+	n = (long) fh.len + fh.f_len + 2;
+	if ( n > len )
+	    oops ( "FIT file is truncated" );
+
+	if ( fh.len >= sizeof(fh) && fh.crc ) {
+	    crc = calc_crc ( buf, sizeof(fh) );
+	    printf ( "Header CRC: %04x\n", crc );
+	    if ( crc )
+		oops ( "Bad header CRC" );
+	}
+
+	crc = par_crc ( buf, n );
+	printf ( "File CRC: %04x (%ld bytes, %d threads)\n", crc, n, crc_threads );
+	if ( n < len )
+	    printf ( "%ld extra bytes after the CRC\n", len - n );
+	if ( crc )
+	    oops ( "Bad file CRC" );
+}
+
+/* Streaming output (-e, -x) goes out as the points get decoded,
+ * so the CRC at the end would only complain after a bad file
+ * had been printed.  With -v (and always for merge) we check it
+ * first, with threads for a big file.  That costs a whole pass
+ * before the first point, so it isn't the default.
+ * Stdin and pipes can't be read twice, so they still get checked
+ * at the end, after the output.
+ * Archives have no FIT CRC, the reader checks those as it goes.
+ */
+void
+check_file ( char *path )
+{
+	struct fit_header fh;
+	struct stat st;
+	u8 *buf;
+	long len;
+	long n;
+
+	if ( strcmp ( path, "-" ) == 0 )
+	    return;
+	if ( stat ( path, &st ) < 0 || ! S_ISREG ( st.st_mode ) || st.st_size < 12 )
+	    return;
+
+	buf = map_file ( path, &len );
+	memcpy ( &fh, buf, len < sizeof(fh) ? 12 : sizeof(fh) );
+	if ( strncmp ( fh.sig, ".FIT", 4 ) != 0 ) {
+	    munmap ( buf, len );
+	    return;
+	}
+
+	n = (long) fh.len + fh.f_len + 2;
+	if ( n > len )
+	    oops ( "FIT file is truncated" );
+	if ( fh.len >= sizeof(fh) && fh.crc && calc_crc ( buf, sizeof(fh) ) )
+	    oops ( "Bad header CRC" );
+	if ( par_crc ( buf, n ) )
+	    oops ( "Bad file CRC" );
+
+	munmap ( buf, len );
+}
+
+/* --------------------------------------------------------- */
+/* Archives --
+ *
+ * A 66i record message is 41 bytes, and half of that is fields
+ * that are always 0xff.  An archive keeps just the 7 values we use,
+ * in columns, each value stored as the change from the one before
+ * as a zigzag varint.  Time mostly goes up by 1 and lat/long don't
+ * move much from second to second, so a point comes to 8 or 10 bytes.
+ *
+ * Points go in blocks of ARC_BLOCK.  Each block starts with a little
+ * header (length, CRC, time range, bounding box), and copies of
+ * those headers with file offsets make an index at the end of the
+ * file, so a reader can go straight to the blocks it wants.
+ * Going through from front to back needs no index, so archives
+ * can be read from a pipe like FIT files.
+ *
+ * fit66 -a in.fit out.f66 - make an archive
+ * fit66 -u in.f66 out.fit - and back to FIT (file ID and records only)
+ * fit66 -u in.f66 out.fit start/end - just the points in that time (UTC)
+ * fit66 -u in.f66 out.fit lat long lat long - just the points in that box
+ * The last two use the index (see arc_select) and only read the
+ * blocks that might have something we want.
+ * Everything that reads FIT files (-e, -m, -d, -i ...) reads archives too.
+ */
+
+#define ARC_BLOCK	1024
+#define ARC_COLS	7
+#define ARC_MAX		(ARC_BLOCK * ARC_COLS * 10)	/* worst case varints */
+#define ARC_VERSION	1
+
+struct __attribute__((__packed__)) arc_header {
+	char sig[4];		/* "F66A" */
+	u16 version;
+	u16 block;		/* points per block */
+	u8 prot_ver;		/* from the FIT file */
+	u8 pad;
+	u16 prof_ver;
+	u32 nblock;
+	u32 npoints;
+	u32 index;		/* file offset of the block index */
+};
+
+struct __attribute__((__packed__)) arc_block {
+	u32 len;		/* bytes of varints that follow */
+	u16 npoints;
+	u16 crc;		/* of those bytes */
+	u32 t0, t1;
+	struct bbox bb;		/* points with a GPS fix */
+};
+
+struct __attribute__((__packed__)) arc_index {
+	u32 offset;		/* of the block header */
+	struct arc_block b;
+};
+
+/* Columns are in make_point order */
+struct arc_out {
+	FILE *fp;
+	u32 off;
+	long col[ARC_COLS][ARC_BLOCK];
+	int n;
+	u32 npoints;
+	struct arc_index *index;
+	int nblock;
+	int maxblock;
+	u8 buf[ARC_MAX];
+};
+
+struct arc_out *arc_op;
+
+static u8 *
+put_varint ( u8 *p, long val )
+{
+	unsigned long v = ((unsigned long) val << 1) ^ (val >> 63);
+
+	while ( v >= 0x80 ) {
+	    *p++ = v | 0x80;
+	    v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static long
+get_varint ( u8 **pp, u8 *end )
+{
+	unsigned long v = 0;
+	int shift = 0;
+	u8 *p = *pp;
+
+	for ( ;; ) {
+	    if ( p >= end || shift > 63 )
+		oops ( "Bad archive block" );
+	    v |= (unsigned long) (*p & 0x7f) << shift;
+	    shift += 7;
+	    if ( ! (*p++ & 0x80) )
+		break;
+	}
+
+	*pp = p;
+	return (v >> 1) ^ -(v & 1);
+}
+
+void
+arc_flush ( struct arc_out *ap )
+{
+	struct arc_index *ip;
+	struct bbox bb;
+	long prev;
+	int lat, lon;
+	u8 *p;
+	int c, i;
+
+	if ( ap->n == 0 )
+	    return;
+
+	if ( ap->nblock >= ap->maxblock ) {
+	    ap->maxblock = ap->maxblock ? ap->maxblock * 2 : 64;
+	    ap->index = realloc ( ap->index, ap->maxblock * sizeof(struct arc_index) );
+	    if ( ! ap->index )
+		oops ( "Out of memory for archive index" );
+	}
+	ip = &ap->index[ap->nblock++];
+
+	p = ap->buf;
+	for ( c=0; c<ARC_COLS; c++ ) {
+	    prev = 0;
+	    for ( i=0; i<ap->n; i++ ) {
+		p = put_varint ( p, ap->col[c][i] - prev );
+		prev = ap->col[c][i];
+	    }
+	}
+
+	ip->offset = ap->off;
+	ip->b.len = p - ap->buf;
+	ip->b.npoints = ap->n;
+	ip->b.crc = crc_block ( 0, ap->buf, ip->b.len );
+	/* Time can go backwards (a merge of overlapping files),
+	 * so this has to be the whole range, not first and last.
+	 */
+	ip->b.t0 = ip->b.t1 = ap->col[0][0];
+	for ( i=1; i<ap->n; i++ ) {
+	    if ( ap->col[0][i] < ip->b.t0 ) ip->b.t0 = ap->col[0][i];
+	    if ( ap->col[0][i] > ip->b.t1 ) ip->b.t1 = ap->col[0][i];
+	}
+
+	/* No fix gives a latitude of 0x7fffffff, way past 90 degrees */
+	bbox_empty ( &bb );
+	for ( i=0; i<ap->n; i++ ) {
+	    lat = ap->col[1][i];
+	    lon = ap->col[2][i];
+	    if ( lat < -0x40000000 || lat > 0x40000000 )
+		continue;
+	    if ( lat < bb.s ) bb.s = lat;
+	    if ( lat > bb.n ) bb.n = lat;
+	    if ( lon < bb.w ) bb.w = lon;
+	    if ( lon > bb.e ) bb.e = lon;
+	}
+	ip->b.bb = bb;
+
+	xwrite ( ap->fp, &ip->b, sizeof(struct arc_block), 1 );
+	xwrite ( ap->fp, ap->buf, 1, ip->b.len );
+	ap->off += sizeof(struct arc_block) + ip->b.len;
+	ap->npoints += ap->n;
+	ap->n = 0;
+}
+
+/* The raw_sink while archiving */
+void
+arc_point ( u32 time, int lat, int lon, int alt, int temp, int speed, int dist )
+{
+	struct arc_out *ap = arc_op;
+	int n = ap->n;
+
+	ap->col[0][n] = time;
+	ap->col[1][n] = lat;
+	ap->col[2][n] = lon;
+	ap->col[3][n] = alt;
+	ap->col[4][n] = temp;
+	ap->col[5][n] = speed;
+	ap->col[6][n] = dist;
+
+	if ( ++ap->n == ARC_BLOCK )
+	    arc_flush ( ap );
+}
+
+/* fit66 -a in out */
+void
+make_archive ( char *in, char *out )
+{
+	struct arc_header ah;
+	struct arc_out *ap;
+
+	ap = calloc ( 1, sizeof(struct arc_out) );
+	if ( ! ap )
+	    oops ( "Out of memory for archive" );
+
+	ap->fp = fopen ( out, "w" );
+	if ( ! ap->fp ) {
+	    printf ( "Output archive: %s\n", out );
+	    oops ( "Cannot open output archive" );
+	}
+
+	/* The real header goes in at the end */
+	memset ( &ah, 0, sizeof(ah) );
+	xwrite ( ap->fp, &ah, sizeof(ah), 1 );
+	ap->off = sizeof(ah);
+
+	arc_op = ap;
+	raw_sink = arc_point;
+	read_fit ( in );
+	raw_sink = NULL;
+	arc_flush ( ap );
+
+	memcpy ( ah.sig, "F66A", 4 );
+	ah.version = ARC_VERSION;
+	ah.block = ARC_BLOCK;
+	ah.prot_ver = hdr.prot_ver;
+	ah.prof_ver = hdr.prof_ver;
+	ah.nblock = ap->nblock;
+	ah.npoints = ap->npoints;
+	ah.index = ap->off;
+
+	xwrite ( ap->fp, ap->index, sizeof(struct arc_index), ap->nblock );
+	ap->off += ap->nblock * sizeof(struct arc_index);
+
+	if ( fseek ( ap->fp, 0, SEEK_SET ) < 0 )
+	    oops ( "Cannot seek output archive" );
+	xwrite ( ap->fp, &ah, sizeof(ah), 1 );
+	if ( fclose ( ap->fp ) )
+	    oops ( "Write error" );
+
+	printf ( "Archived %u points in %d blocks, %u bytes (%.1f bytes per point)\n",
+	    ap->npoints, ap->nblock, ap->off,
+	    ap->npoints ? (double) ap->off / ap->npoints : 0.0 );
+
+	free ( ap->index );
+	free ( ap );
+}
+
+/* What arc_select wants, checked point by point */
+int arc_by_time;
+u32 arc_t0, arc_t1;
+int arc_by_box;
+struct bbox arc_box;
+
+int
+arc_want ( u32 time, int lat, int lon )
+{
+	if ( arc_by_time && (time < arc_t0 || time > arc_t1) )
+	    return 0;
+	if ( arc_by_box && (lat < arc_box.s || lat > arc_box.n || lon < arc_box.w || lon > arc_box.e) )
+	    return 0;
+	return 1;
+}
+
+/* Undo the varints in one block and send the points along */
+void
+arc_points ( u8 *buf, struct arc_block *ab )
+{
+	static __thread long col[ARC_COLS][ARC_BLOCK];
+	long val;
+	u8 *p;
+	int c, i;
+
+	if ( crc_block ( 0, buf, ab->len ) != ab->crc )
+	    oops ( "Bad archive block CRC" );
+
+	p = buf;
+	for ( c=0; c<ARC_COLS; c++ ) {
+	    val = 0;
+	    for ( i=0; i<ab->npoints; i++ ) {
+		val += get_varint ( &p, buf + ab->len );
+		col[c][i] = val;
+	    }
+	}
+
+	for ( i=0; i<ab->npoints; i++ )
+	    if ( arc_want ( col[0][i], col[1][i], col[2][i] ) )
+		make_point ( col[0][i], col[1][i], col[2][i], col[3][i],
+		    col[4][i], col[5][i], col[6][i] );
+}
+
+/* Called by read_fit when the file turns out to be an archive.
+ * We just go through the blocks in order.
+ */
+void
+read_archive ( void )
+{
+	static __thread u8 buf[ARC_MAX];
+	struct arc_header ah;
+	struct arc_block ab;
+	int b;
+
+	readn ( (u8 *) &ah, sizeof(ah) );
+	if ( strncmp ( ah.sig, "F66A", 4 ) != 0 ) {
+	    printf ( "Not a FIT file\n" );
+	    if ( oops_jmp )
+		longjmp ( *oops_jmp, 1 );
+	    exit ( 2 );
+	}
+	if ( ah.version != ARC_VERSION )
+	    oops ( "Unknown archive version" );
+
+	/* -u wants these for the FIT header */
+	hdr.prot_ver = ah.prot_ver;
+	hdr.prof_ver = ah.prof_ver;
+
+	if ( dump_level )
+	    printf ( "Archive: %u points in %u blocks\n", ah.npoints, ah.nblock );
+
+	for ( b=0; b<ah.nblock; b++ ) {
+	    readn ( (u8 *) &ab, sizeof(ab) );
+	    if ( ab.len > ARC_MAX || ab.npoints > ARC_BLOCK )
+		oops ( "Bad archive block" );
+	    readn ( buf, ab.len );
+
+	    if ( dump_level ) {
+		printf ( "Block %d: %d points, %u bytes, %s", b, ab.npoints, ab.len, tstamp ( ab.t0 ) );
+		printf ( " to %s\n", tstamp ( ab.t1 ) );
+	    }
+
+	    arc_points ( buf, &ab );
+	}
+}
+
+/* Like read_archive, but go to the index first and only read
+ * the blocks whose time range or bounding box could have
+ * points we want (see arc_want).  This needs a real file.
+ * Returns how many blocks got read.
+ */
+int
+arc_select ( char *path, struct arc_header *ahp )
+{
+	static u8 buf[ARC_MAX];
+	struct arc_index *index;
+	struct arc_block *bp;
+	struct bbox bb;
+	int fd;
+	int b, nread;
+
+	if ( strcmp ( path, "-" ) == 0 )
+	    oops ( "Picking points needs an archive file, not stdin" );
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 ) {
+	    printf ( "Input archive: %s\n", path );
+	    oops ( "Cannot open input archive" );
+	}
+
+	if ( pread ( fd, ahp, sizeof(*ahp), 0 ) != sizeof(*ahp) || strncmp ( ahp->sig, "F66A", 4 ) != 0 )
+	    oops ( "Not an archive (picking points needs one)" );
+	if ( ahp->version != ARC_VERSION )
+	    oops ( "Unknown archive version" );
+
+	index = malloc ( ahp->nblock * sizeof(struct arc_index) + 1 );
+	if ( ! index )
+	    oops ( "Out of memory for archive index" );
+	if ( pread ( fd, index, ahp->nblock * sizeof(struct arc_index), ahp->index ) !=
+		ahp->nblock * sizeof(struct arc_index) )
+	    oops ( "Cannot read archive index" );
+
+	nread = 0;
+	for ( b=0; b<ahp->nblock; b++ ) {
+	    bp = &index[b].b;
+	    if ( arc_by_time && (bp->t1 < arc_t0 || bp->t0 > arc_t1) )
+		continue;
+	    bb = bp->bb;
+	    if ( arc_by_box && ! bbox_hit ( &bb, &arc_box ) )
+		continue;
+
+	    if ( bp->len > ARC_MAX || bp->npoints > ARC_BLOCK )
+		oops ( "Bad archive block" );
+	    if ( pread ( fd, buf, bp->len, index[b].offset + sizeof(struct arc_block) ) != bp->len )
+		oops ( "Cannot read archive block" );
+	    arc_points ( buf, bp );
+	    nread++;
+	}
+
+	free ( index );
+	close ( fd );
+	return nread;
+}
+
+/* -u takes start/end or lat long lat long after the file names */
+void
+arc_select_arg ( char **args, int nargs )
+{
+	struct data pt;
+	char *p;
+
+	if ( nargs == 1 ) {
+	    p = strchr ( args[0], '/' );
+	    if ( ! p )
+		oops ( "Time windows look like start/end" );
+	    arc_by_time = 1;
+	    arc_t0 = iso_parse ( args[0] );
+	    arc_t1 = iso_parse ( p+1 );
+	} else if ( nargs == 4 ) {
+	    arc_by_box = 1;
+	    bbox_empty ( &arc_box );
+	    pt.lat = atof ( args[0] );
+	    pt.lon = atof ( args[1] );
+	    bbox_add ( &arc_box, &pt );
+	    pt.lat = atof ( args[2] );
+	    pt.lon = atof ( args[3] );
+	    bbox_add ( &arc_box, &pt );
+	} else
+	    oops ( "Usage: fit66 -u in.f66 out.fit [start/end | lat long lat long]" );
+}
+
+struct fit_out *unarc_op;
+
+/* The raw_sink for going back to FIT */
+void
+unarc_point ( u32 time, int lat, int lon, int alt, int temp, int speed, int dist )
+{
+	static struct field fid_fields[] = {
+	    { 0, 1, 0x00 },	/* type */
+	    { 1, 2, 0x84 },	/* manufacturer */
+	    { 4, 4, 0x86 },	/* time created */
+	};
+	struct __attribute__((__packed__)) { u8 type; u16 manuf; u32 time; } fid;
+	struct rec_F66 rec;
+	u8 raw[DEF_MAX];
+
+	/* The file ID goes first, it has to be an activity */
+	if ( unarc_op->nmsg == 0 ) {
+	    raw[0] = H_DEF;
+	    raw[1] = raw[2] = 0;
+	    raw[3] = GID_FILE_ID;
+	    raw[4] = 0;
+	    raw[5] = 3;
+	    memcpy ( &raw[6], fid_fields, sizeof(fid_fields) );
+	    fid.type = 4;		/* activity */
+	    fid.manuf = 255;		/* development */
+	    fid.time = time;
+	    out_data ( unarc_op, raw, 6 + sizeof(fid_fields), (u8 *) &fid, sizeof(fid) );
+	}
+
+	raw[0] = H_DEF;
+	raw[1] = raw[2] = 0;
+	raw[3] = GID_RECORD;
+	raw[4] = 0;
+	raw[5] = sizeof(fields_F66) / sizeof(struct field);
+	memcpy ( &raw[6], fields_F66, sizeof(fields_F66) );
+
+	rec.f_253 = time;
+	rec.f_0 = lat;
+	rec.f_1 = lon;
+	rec.f_5 = dist;
+	rec.f_73 = speed;
+	rec.f_78 = alt;
+	rec.f_13 = temp;
+	out_data ( unarc_op, raw, 6 + sizeof(fields_F66), (u8 *) &rec, sizeof(rec) );
+}
+
+/* fit66 -u in out [start/end | lat long lat long] */
+void
+unarchive ( char *in, char *out, char **args, int nargs )
+{
+	struct arc_header ah;
+	int nread;
+
+	if ( nargs )
+	    arc_select_arg ( args, nargs );
+
+	unarc_op = out_open ( out );
+	raw_sink = unarc_point;
+	if ( nargs ) {
+	    nread = arc_select ( in, &ah );
+	    hdr.prot_ver = ah.prot_ver;
+	    hdr.prof_ver = ah.prof_ver;
+	    printf ( "Read %d of %u blocks\n", nread, ah.nblock );
+	} else
+	    read_fit ( in );
+	raw_sink = NULL;
+
+	printf ( "Wrote %d messages, %u bytes\n", unarc_op->nmsg, unarc_op->nbytes );
+	out_close ( unarc_op, &hdr );
+}
+
+/* --------------------------------------------------------- */
+/* --------------------------------------------------------- */
+
+/* Actual usage:
+ * fit66 path is the same as fit66 -e path
+ * a path of "-" means read from stdin (for -e, -d, -t and -M)
+ * fit66 -e path - extracts records as ascii
+ * -f - flush extract output after every point (for pipes)
+ * -p - read, decode and print in separate threads (for -e and -x)
+ * -v - check the file CRC before any output (for -e and -x)
+ * -c time,lat,lon - extract just these columns (see col_arg)
+ * -gW:T - smoothed altitude, median of W points, T feet hysteresis
+ * fit66 -d path - dumps the file for analysis
+ * fit66 -t path - trims the file (not quite done)
+ *   (see NTRIM below)
+ * fit66 -m path - derived distance, grade, vertical speed, moving time
+ * fit66 -i dir index - build a spatial index of the FIT files in dir
+ * fit66 -w index lat long [lat long] - which files touch this quad (or box)
+ * fit66 -M out in1 in2 ... - merge several files into one
+ * -rN[:G] - resample extract (and -m) output every N seconds, G is the gap
+ * fit66 -C path - check the file CRC, using threads for big files
+ * -jN - use N threads for the things that can use them
+ * -q - keep points in memory as scaled integers (less memory)
+ * fit66 -a in.fit out.f66 - make a compact archive
+ * fit66 -u in.f66 out.fit [start/end | lat long lat long] - archive back to FIT
+ * fit66 -z in.fit out.fit - re-encode smaller (compressed timestamps)
+ * fit66 -x gpx|geojson|csv path - export to stdout
+ * fit66 -sSPEC in.fit prefix - split into prefix-1.fit ... (see split_file)
+ * fit66 -n path - answer nearest point questions on stdin (see near_cmd)
+ * fit66 --heatmap dir out.pgm lat long [lat long] - track density (see heatmap)
+ *   --res=N - heatmap pixels per quad side
+ * fit66 --dups dir - find duplicate and overlapping files (see find_dups)
+ */
+
+enum cmd { EXTRACT, DUMP, TRIM, METRICS, INDEX, QUERY, MERGE, CRC, ARCHIVE, UNARCHIVE, REENCODE, EXPORT, SPLIT, NEAR, HEATMAP, DUPS };
+
+enum cmd cmd = EXTRACT;
+
+char *limits;
+char **cmd_args;
+int cmd_nargs;
+
+void
+usage ( void )
+{
+	oops ( "Usage: fit66 -e path" );
+}
+
+void
+usage_t ( void )
+{
+	oops ( "Usage: fit66 -t sstart:end inpath outpath" );
+}
+
+void
+cmdline ( int argc, char **argv )
+{
+	char *p;
+
+	while ( argc ) {
+	    p = *argv;
+	    /* A plain "-" is stdin, not an option */
+	    if ( *p != '-' || p[1] == '\0' )
 		break;
 
 	    /* Forget this.
@@ -1124,6 +7446,66 @@ cmdline ( int argc, char **argv )
 		cmd = DUMP;
 	    if ( p[1] == 'e' )
 		cmd = EXTRACT;
+	    if ( p[1] == 'm' )
+		cmd = METRICS;
+	    if ( p[1] == 'i' )
+		cmd = INDEX;
+	    if ( p[1] == 'w' )
+		cmd = QUERY;
+	    if ( p[1] == 'M' )
+		cmd = MERGE;
+	    if ( p[1] == 'C' )
+		cmd = CRC;
+	    if ( p[1] == 'a' )
+		cmd = ARCHIVE;
+	    if ( p[1] == 'u' )
+		cmd = UNARCHIVE;
+	    if ( p[1] == 'z' )
+		cmd = REENCODE;
+	    if ( p[1] == 'n' )
+		cmd = NEAR;
+	    if ( p[1] == 's' ) {
+		cmd = SPLIT;
+		split_arg ( &p[2] );
+	    }
+	    if ( p[1] == 'x' ) {
+		cmd = EXPORT;
+		if ( argc < 2 )
+		    oops ( "Usage: fit66 -x gpx|geojson|csv path" );
+		argc--;
+		argv++;
+		export_arg ( *argv );
+	    }
+	    if ( p[1] == 'j' )
+		nthreads = atoi ( &p[2] );
+	    if ( p[1] == 'r' )
+		resample_arg ( &p[2] );
+	    if ( p[1] == 'q' )
+		quantize = 1;
+	    if ( p[1] == 'f' )
+		e_flush = 1;
+	    if ( p[1] == 'p' )
+		pipe_mode = 1;
+	    if ( p[1] == 'v' )
+		check_first = 1;
+	    if ( p[1] == 'g' )
+		smooth_arg ( &p[2] );
+	    if ( strcmp ( p, "--heatmap" ) == 0 )
+		cmd = HEATMAP;
+	    if ( strcmp ( p, "--dups" ) == 0 )
+		cmd = DUPS;
+	    if ( strncmp ( p, "--res=", 6 ) == 0 ) {
+		heat_res = atoi ( &p[6] );
+		if ( heat_res < 1 )
+		    oops ( "Usage: --res=pixels (per quad side)" );
+	    }
+	    if ( p[1] == 'c' ) {
+		if ( argc < 2 )
+		    oops ( "Usage: fit66 -c time,lat,lon -e path" );
+		argc--;
+		argv++;
+		col_arg ( *argv );
+	    }
 
 	    argc--;
 	    argv++;
@@ -1136,6 +7518,47 @@ cmdline ( int argc, char **argv )
 	    limits = argv[0];
 	    in_path = argv[1];
 	    out_path = argv[2];
+	} else if ( cmd == INDEX ) {
+	    if ( argc != 2 )
+		oops ( "Usage: fit66 -i dir index" );
+	    in_path = argv[0];
+	    out_path = argv[1];
+	} else if ( cmd == HEATMAP ) {
+	    if ( argc != 4 && argc != 6 )
+		oops ( "Usage: fit66 --heatmap dir out.pgm lat long [lat long]" );
+	    in_path = argv[0];
+	    out_path = argv[1];
+	    cmd_args = &argv[2];
+	    cmd_nargs = argc - 2;
+	} else if ( cmd == SPLIT ) {
+	    if ( argc != 2 )
+		oops ( "Usage: fit66 -sSPEC inpath prefix" );
+	    in_path = argv[0];
+	    s_prefix = argv[1];
+	} else if ( cmd == UNARCHIVE ) {
+	    if ( argc != 2 && argc != 3 && argc != 6 )
+		oops ( "Usage: fit66 -u in.f66 out.fit [start/end | lat long lat long]" );
+	    in_path = argv[0];
+	    out_path = argv[1];
+	    cmd_args = &argv[2];
+	    cmd_nargs = argc - 2;
+	} else if ( cmd == ARCHIVE || cmd == REENCODE ) {
+	    if ( argc != 2 )
+		oops ( "Usage: fit66 -a|-u|-z inpath outpath" );
+	    in_path = argv[0];
+	    out_path = argv[1];
+	} else if ( cmd == QUERY ) {
+	    if ( argc != 3 && argc != 5 )
+		oops ( "Usage: fit66 -w index lat long [lat long]" );
+	    in_path = argv[0];
+	    cmd_args = &argv[1];
+	    cmd_nargs = argc - 1;
+	} else if ( cmd == MERGE ) {
+	    if ( argc < 2 )
+		oops ( "Usage: fit66 -M outpath inpath ..." );
+	    out_path = argv[0];
+	    cmd_args = &argv[1];
+	    cmd_nargs = argc - 1;
 	} else {
 	    if ( argc > 0 )
 		in_path = *argv;
@@ -1164,8 +7587,82 @@ main ( int argc, char **argv )
 	}
 
 	if ( cmd == EXTRACT ) {
+	    extract_file ();
+	    return 0;
+	}
+
+	/* The summary always has ascent and descent */
+	if ( cmd == METRICS ) {
+	    sm_on = 1;
+	    smooth_setup ();
+	}
+
+	if ( cmd == METRICS || cmd == NEAR )
+	    resample_setup ();
+
+	if ( cmd == METRICS ) {
 	    read_file ();
-	    show_data ();
+	    show_metrics ();
+	    return 0;
+	}
+
+	if ( cmd == NEAR ) {
+	    near_cmd ();
+	    return 0;
+	}
+
+	if ( cmd == HEATMAP ) {
+	    heatmap ( in_path, out_path, cmd_args, cmd_nargs );
+	    return 0;
+	}
+
+	if ( cmd == DUPS ) {
+	    find_dups ( in_path );
+	    return 0;
+	}
+
+	if ( cmd == INDEX ) {
+	    build_index ( in_path, out_path );
+	    return 0;
+	}
+
+	if ( cmd == QUERY ) {
+	    query_cmd ( in_path, cmd_args, cmd_nargs );
+	    return 0;
+	}
+
+	if ( cmd == MERGE ) {
+	    merge_files ( out_path, cmd_args, cmd_nargs );
+	    return 0;
+	}
+
+	if ( cmd == CRC ) {
+	    crc_file ( in_path );
+	    return 0;
+	}
+
+	if ( cmd == ARCHIVE ) {
+	    make_archive ( in_path, out_path );
+	    return 0;
+	}
+
+	if ( cmd == UNARCHIVE ) {
+	    unarchive ( in_path, out_path, cmd_args, cmd_nargs );
+	    return 0;
+	}
+
+	if ( cmd == REENCODE ) {
+	    reencode ( in_path, out_path );
+	    return 0;
+	}
+
+	if ( cmd == EXPORT ) {
+	    export_file ( in_path );
+	    return 0;
+	}
+
+	if ( cmd == SPLIT ) {
+	    split_file ( in_path );
 	    return 0;
 	}
 
@@ -0,0 +1,555 @@
+/* profile.h -- FIT profile tables for fit66
+ *
+ * Message and field numbers, names, scales, offsets and units
+ * copied out of the Profile spreadsheet in the FIT SDK
+ * (the "Messages" sheet, using the SDK's own names).
+ *
+ * Both tables are indexed directly by number (C designated
+ * initializers), so a lookup is just an array index.
+ * The arrays come out as long as the biggest number in them,
+ * and the holes are zero, which means "not in the profile".
+ *
+ * This copy was done by hand, and the SDK version it came from did
+ * not get written down.  Every message number in the profile is here,
+ * but fields are only filled in for the messages I have some reason
+ * to look at.  To check it or get every field of every message, run
+ * mkprofile on Profile.xlsx from the SDK (see "make profile"), which
+ * writes this same file, with the SDK version up here.
+ *
+ * A scale of 0 means 1.
+ * Units of "date" mean a FIT timestamp (seconds since 1989)
+ * and "semicircles" get shown as degrees.
+ */
+
+struct pfield {
+	char *name;
+	double scale;
+	double offset;
+	char *units;
+};
+
+struct pmesg {
+	char *name;
+	struct pfield *field;
+	int nfield;
+};
+
+/* These two are the same in every message */
+struct pfield pf_timestamp = { "timestamp", 0, 0, "date" };
+struct pfield pf_message_index = { "message_index" };
+
+struct pfield pf_file_id[] = {
+    [0] = { "type" },
+    [1] = { "manufacturer" },
+    [2] = { "product" },
+    [3] = { "serial_number" },
+    [4] = { "time_created", 0, 0, "date" },
+    [5] = { "number" },
+    [8] = { "product_name" },
+};
+
+struct pfield pf_file_creator[] = {
+    [0] = { "software_version" },
+    [1] = { "hardware_version" },
+};
+
+struct pfield pf_sport[] = {
+    [0] = { "sport" },
+    [1] = { "sub_sport" },
+    [3] = { "name" },
+};
+
+struct pfield pf_session[] = {
+    [0] = { "event" },
+    [1] = { "event_type" },
+    [2] = { "start_time", 0, 0, "date" },
+    [3] = { "start_position_lat", 0, 0, "semicircles" },
+    [4] = { "start_position_long", 0, 0, "semicircles" },
+    [5] = { "sport" },
+    [6] = { "sub_sport" },
+    [7] = { "total_elapsed_time", 1000, 0, "s" },
+    [8] = { "total_timer_time", 1000, 0, "s" },
+    [9] = { "total_distance", 100, 0, "m" },
+    [10] = { "total_cycles", 0, 0, "cycles" },
+    [11] = { "total_calories", 0, 0, "kcal" },
+    [13] = { "total_fat_calories", 0, 0, "kcal" },
+    [14] = { "avg_speed", 1000, 0, "m/s" },
+    [15] = { "max_speed", 1000, 0, "m/s" },
+    [16] = { "avg_heart_rate", 0, 0, "bpm" },
+    [17] = { "max_heart_rate", 0, 0, "bpm" },
+    [18] = { "avg_cadence", 0, 0, "rpm" },
+    [19] = { "max_cadence", 0, 0, "rpm" },
+    [20] = { "avg_power", 0, 0, "watts" },
+    [21] = { "max_power", 0, 0, "watts" },
+    [22] = { "total_ascent", 0, 0, "m" },
+    [23] = { "total_descent", 0, 0, "m" },
+    [24] = { "total_training_effect", 10 },
+    [25] = { "first_lap_index" },
+    [26] = { "num_laps" },
+    [27] = { "event_group" },
+    [28] = { "trigger" },
+    [29] = { "nec_lat", 0, 0, "semicircles" },
+    [30] = { "nec_long", 0, 0, "semicircles" },
+    [31] = { "swc_lat", 0, 0, "semicircles" },
+    [32] = { "swc_long", 0, 0, "semicircles" },
+    [33] = { "num_lengths", 0, 0, "lengths" },
+    [34] = { "normalized_power", 0, 0, "watts" },
+    [35] = { "training_stress_score", 10, 0, "tss" },
+    [36] = { "intensity_factor", 1000, 0, "if" },
+    [37] = { "left_right_balance" },
+    [38] = { "end_position_lat", 0, 0, "semicircles" },
+    [39] = { "end_position_long", 0, 0, "semicircles" },
+    [41] = { "avg_stroke_count", 10, 0, "strokes/lap" },
+    [42] = { "avg_stroke_distance", 100, 0, "m" },
+    [43] = { "swim_stroke" },
+    [44] = { "pool_length", 100, 0, "m" },
+    [45] = { "threshold_power", 0, 0, "watts" },
+    [46] = { "pool_length_unit" },
+    [47] = { "num_active_lengths", 0, 0, "lengths" },
+    [48] = { "total_work", 0, 0, "J" },
+    [49] = { "avg_altitude", 5, 500, "m" },
+    [50] = { "max_altitude", 5, 500, "m" },
+    [51] = { "gps_accuracy", 0, 0, "m" },
+    [52] = { "avg_grade", 100, 0, "%" },
+    [53] = { "avg_pos_grade", 100, 0, "%" },
+    [54] = { "avg_neg_grade", 100, 0, "%" },
+    [55] = { "max_pos_grade", 100, 0, "%" },
+    [56] = { "max_neg_grade", 100, 0, "%" },
+    [57] = { "avg_temperature", 0, 0, "C" },
+    [58] = { "max_temperature", 0, 0, "C" },
+    [59] = { "total_moving_time", 1000, 0, "s" },
+    [60] = { "avg_pos_vertical_speed", 1000, 0, "m/s" },
+    [61] = { "avg_neg_vertical_speed", 1000, 0, "m/s" },
+    [62] = { "max_pos_vertical_speed", 1000, 0, "m/s" },
+    [63] = { "max_neg_vertical_speed", 1000, 0, "m/s" },
+    [64] = { "min_heart_rate", 0, 0, "bpm" },
+    [65] = { "time_in_hr_zone", 1000, 0, "s" },
+    [66] = { "time_in_speed_zone", 1000, 0, "s" },
+    [67] = { "time_in_cadence_zone", 1000, 0, "s" },
+    [68] = { "time_in_power_zone", 1000, 0, "s" },
+    [69] = { "avg_lap_time", 1000, 0, "s" },
+    [70] = { "best_lap_index" },
+    [71] = { "min_altitude", 5, 500, "m" },
+    [82] = { "player_score" },
+    [83] = { "opponent_score" },
+    [84] = { "opponent_name" },
+    [85] = { "stroke_count", 0, 0, "counts" },
+    [86] = { "zone_count", 0, 0, "counts" },
+    [87] = { "max_ball_speed", 100, 0, "m/s" },
+    [88] = { "avg_ball_speed", 100, 0, "m/s" },
+    [89] = { "avg_vertical_oscillation", 10, 0, "mm" },
+    [90] = { "avg_stance_time_percent", 100, 0, "%" },
+    [91] = { "avg_stance_time", 10, 0, "ms" },
+    [92] = { "avg_fractional_cadence", 128, 0, "rpm" },
+    [93] = { "max_fractional_cadence", 128, 0, "rpm" },
+    [94] = { "total_fractional_cycles", 128, 0, "cycles" },
+    [110] = { "sport_profile_name" },
+    [111] = { "sport_index" },
+    [112] = { "time_standing", 1000, 0, "s" },
+    [113] = { "stand_count" },
+    [124] = { "enhanced_avg_speed", 1000, 0, "m/s" },
+    [125] = { "enhanced_max_speed", 1000, 0, "m/s" },
+    [126] = { "enhanced_avg_altitude", 5, 500, "m" },
+    [127] = { "enhanced_min_altitude", 5, 500, "m" },
+    [128] = { "enhanced_max_altitude", 5, 500, "m" },
+    [137] = { "total_anaerobic_training_effect", 10 },
+    [168] = { "training_load_peak", 65536 },
+    [169] = { "enhanced_avg_respiration_rate", 100, 0, "breaths/min" },
+    [170] = { "enhanced_max_respiration_rate", 100, 0, "breaths/min" },
+    [180] = { "enhanced_min_respiration_rate", 100, 0, "breaths/min" },
+    [181] = { "total_grit", 0, 0, "kGrit" },
+    [182] = { "total_flow", 0, 0, "Flow" },
+    [183] = { "jump_count" },
+    [186] = { "avg_grit", 0, 0, "kGrit" },
+    [187] = { "avg_flow", 0, 0, "Flow" },
+    [194] = { "avg_spo2", 0, 0, "percent" },
+    [195] = { "avg_stress", 0, 0, "percent" },
+    [197] = { "sdrr_hrv", 0, 0, "mS" },
+    [198] = { "rmssd_hrv", 0, 0, "mS" },
+    [199] = { "total_fractional_ascent", 100, 0, "m" },
+    [200] = { "total_fractional_descent", 100, 0, "m" },
+    [208] = { "avg_core_temperature", 100, 0, "C" },
+    [209] = { "min_core_temperature", 100, 0, "C" },
+    [210] = { "max_core_temperature", 100, 0, "C" },
+};
+
+struct pfield pf_lap[] = {
+    [0] = { "event" },
+    [1] = { "event_type" },
+    [2] = { "start_time", 0, 0, "date" },
+    [3] = { "start_position_lat", 0, 0, "semicircles" },
+    [4] = { "start_position_long", 0, 0, "semicircles" },
+    [5] = { "end_position_lat", 0, 0, "semicircles" },
+    [6] = { "end_position_long", 0, 0, "semicircles" },
+    [7] = { "total_elapsed_time", 1000, 0, "s" },
+    [8] = { "total_timer_time", 1000, 0, "s" },
+    [9] = { "total_distance", 100, 0, "m" },
+    [10] = { "total_cycles", 0, 0, "cycles" },
+    [11] = { "total_calories", 0, 0, "kcal" },
+    [12] = { "total_fat_calories", 0, 0, "kcal" },
+    [13] = { "avg_speed", 1000, 0, "m/s" },
+    [14] = { "max_speed", 1000, 0, "m/s" },
+    [15] = { "avg_heart_rate", 0, 0, "bpm" },
+    [16] = { "max_heart_rate", 0, 0, "bpm" },
+    [17] = { "avg_cadence", 0, 0, "rpm" },
+    [18] = { "max_cadence", 0, 0, "rpm" },
+    [19] = { "avg_power", 0, 0, "watts" },
+    [20] = { "max_power", 0, 0, "watts" },
+    [21] = { "total_ascent", 0, 0, "m" },
+    [22] = { "total_descent", 0, 0, "m" },
+    [23] = { "intensity" },
+    [24] = { "lap_trigger" },
+    [25] = { "sport" },
+    [26] = { "event_group" },
+    [32] = { "num_lengths", 0, 0, "lengths" },
+    [33] = { "normalized_power", 0, 0, "watts" },
+    [34] = { "left_right_balance" },
+    [35] = { "first_length_index" },
+    [37] = { "avg_stroke_distance", 100, 0, "m" },
+    [38] = { "swim_stroke" },
+    [39] = { "sub_sport" },
+    [40] = { "num_active_lengths", 0, 0, "lengths" },
+    [41] = { "total_work", 0, 0, "J" },
+    [42] = { "avg_altitude", 5, 500, "m" },
+    [43] = { "max_altitude", 5, 500, "m" },
+    [44] = { "gps_accuracy", 0, 0, "m" },
+    [45] = { "avg_grade", 100, 0, "%" },
+    [46] = { "avg_pos_grade", 100, 0, "%" },
+    [47] = { "avg_neg_grade", 100, 0, "%" },
+    [48] = { "max_pos_grade", 100, 0, "%" },
+    [49] = { "max_neg_grade", 100, 0, "%" },
+    [50] = { "avg_temperature", 0, 0, "C" },
+    [51] = { "max_temperature", 0, 0, "C" },
+    [52] = { "total_moving_time", 1000, 0, "s" },
+    [53] = { "avg_pos_vertical_speed", 1000, 0, "m/s" },
+    [54] = { "avg_neg_vertical_speed", 1000, 0, "m/s" },
+    [55] = { "max_pos_vertical_speed", 1000, 0, "m/s" },
+    [56] = { "max_neg_vertical_speed", 1000, 0, "m/s" },
+    [57] = { "time_in_hr_zone", 1000, 0, "s" },
+    [58] = { "time_in_speed_zone", 1000, 0, "s" },
+    [59] = { "time_in_cadence_zone", 1000, 0, "s" },
+    [60] = { "time_in_power_zone", 1000, 0, "s" },
+    [61] = { "repetition_num" },
+    [62] = { "min_altitude", 5, 500, "m" },
+    [63] = { "min_heart_rate", 0, 0, "bpm" },
+    [71] = { "wkt_step_index" },
+    [74] = { "opponent_score" },
+    [75] = { "stroke_count", 0, 0, "counts" },
+    [76] = { "zone_count", 0, 0, "counts" },
+    [77] = { "avg_vertical_oscillation", 10, 0, "mm" },
+    [78] = { "avg_stance_time_percent", 100, 0, "%" },
+    [79] = { "avg_stance_time", 10, 0, "ms" },
+    [80] = { "avg_fractional_cadence", 128, 0, "rpm" },
+    [81] = { "max_fractional_cadence", 128, 0, "rpm" },
+    [82] = { "total_fractional_cycles", 128, 0, "cycles" },
+    [83] = { "player_score" },
+    [110] = { "enhanced_avg_speed", 1000, 0, "m/s" },
+    [111] = { "enhanced_max_speed", 1000, 0, "m/s" },
+    [112] = { "enhanced_avg_altitude", 5, 500, "m" },
+    [113] = { "enhanced_min_altitude", 5, 500, "m" },
+    [114] = { "enhanced_max_altitude", 5, 500, "m" },
+};
+
+struct pfield pf_record[] = {
+    [0] = { "position_lat", 0, 0, "semicircles" },
+    [1] = { "position_long", 0, 0, "semicircles" },
+    [2] = { "altitude", 5, 500, "m" },
+    [3] = { "heart_rate", 0, 0, "bpm" },
+    [4] = { "cadence", 0, 0, "rpm" },
+    [5] = { "distance", 100, 0, "m" },
+    [6] = { "speed", 1000, 0, "m/s" },
+    [7] = { "power", 0, 0, "watts" },
+    [8] = { "compressed_speed_distance" },
+    [9] = { "grade", 100, 0, "%" },
+    [10] = { "resistance" },
+    [11] = { "time_from_course", 1000, 0, "s" },
+    [12] = { "cycle_length", 100, 0, "m" },
+    [13] = { "temperature", 0, 0, "C" },
+    [17] = { "speed_1s", 16, 0, "m/s" },
+    [18] = { "cycles", 0, 0, "cycles" },
+    [19] = { "total_cycles", 0, 0, "cycles" },
+    [28] = { "compressed_accumulated_power", 0, 0, "watts" },
+    [29] = { "accumulated_power", 0, 0, "watts" },
+    [30] = { "left_right_balance" },
+    [31] = { "gps_accuracy", 0, 0, "m" },
+    [32] = { "vertical_speed", 1000, 0, "m/s" },
+    [33] = { "calories", 0, 0, "kcal" },
+    [39] = { "vertical_oscillation", 10, 0, "mm" },
+    [40] = { "stance_time_percent", 100, 0, "percent" },
+    [41] = { "stance_time", 10, 0, "ms" },
+    [42] = { "activity_type" },
+    [43] = { "left_torque_effectiveness", 2, 0, "percent" },
+    [44] = { "right_torque_effectiveness", 2, 0, "percent" },
+    [45] = { "left_pedal_smoothness", 2, 0, "percent" },
+    [46] = { "right_pedal_smoothness", 2, 0, "percent" },
+    [47] = { "combined_pedal_smoothness", 2, 0, "percent" },
+    [48] = { "time128", 128, 0, "s" },
+    [49] = { "stroke_type" },
+    [50] = { "zone" },
+    [51] = { "ball_speed", 100, 0, "m/s" },
+    [52] = { "cadence256", 256, 0, "rpm" },
+    [53] = { "fractional_cadence", 128, 0, "rpm" },
+    [54] = { "total_hemoglobin_conc", 100, 0, "g/dL" },
+    [55] = { "total_hemoglobin_conc_min", 100, 0, "g/dL" },
+    [56] = { "total_hemoglobin_conc_max", 100, 0, "g/dL" },
+    [57] = { "saturated_hemoglobin_percent", 10, 0, "%" },
+    [58] = { "saturated_hemoglobin_percent_min", 10, 0, "%" },
+    [59] = { "saturated_hemoglobin_percent_max", 10, 0, "%" },
+    [62] = { "device_index" },
+    [67] = { "left_pco", 0, 0, "mm" },
+    [68] = { "right_pco", 0, 0, "mm" },
+    [69] = { "left_power_phase", 0.7111111, 0, "degrees" },
+    [70] = { "left_power_phase_peak", 0.7111111, 0, "degrees" },
+    [71] = { "right_power_phase", 0.7111111, 0, "degrees" },
+    [72] = { "right_power_phase_peak", 0.7111111, 0, "degrees" },
+    [73] = { "enhanced_speed", 1000, 0, "m/s" },
+    [78] = { "enhanced_altitude", 5, 500, "m" },
+    [81] = { "battery_soc", 2, 0, "percent" },
+    [82] = { "motor_power", 0, 0, "watts" },
+    [83] = { "vertical_ratio", 100, 0, "percent" },
+    [84] = { "stance_time_balance", 100, 0, "percent" },
+    [85] = { "step_length", 10, 0, "mm" },
+    [87] = { "cycle_length16", 100, 0, "m" },
+    [91] = { "absolute_pressure", 0, 0, "Pa" },
+    [92] = { "depth", 1000, 0, "m" },
+    [93] = { "next_stop_depth", 1000, 0, "m" },
+    [94] = { "next_stop_time", 0, 0, "s" },
+    [95] = { "time_to_surface", 0, 0, "s" },
+    [96] = { "ndl_time", 0, 0, "s" },
+    [97] = { "cns_load", 0, 0, "percent" },
+    [98] = { "n2_load", 0, 0, "percent" },
+    [99] = { "respiration_rate", 0, 0, "s" },
+    [108] = { "enhanced_respiration_rate", 100, 0, "Breaths/min" },
+    [114] = { "grit" },
+    [115] = { "flow" },
+    [116] = { "current_stress", 100 },
+    [117] = { "ebike_travel_range", 0, 0, "km" },
+    [118] = { "ebike_battery_level", 0, 0, "percent" },
+    [119] = { "ebike_assist_mode" },
+    [120] = { "ebike_assist_level_percent", 0, 0, "percent" },
+    [123] = { "air_time_remaining", 0, 0, "s" },
+    [124] = { "pressure_sac", 100, 0, "bar/min" },
+    [125] = { "volume_sac", 100, 0, "L/min" },
+    [126] = { "rmv", 100, 0, "L/min" },
+    [127] = { "ascent_rate", 1000, 0, "m/s" },
+    [129] = { "po2", 100, 0, "percent" },
+    [136] = { "wrist_heart_rate", 0, 0, "bpm" },
+    [139] = { "core_temperature", 100, 0, "C" },
+};
+
+struct pfield pf_event[] = {
+    [0] = { "event" },
+    [1] = { "event_type" },
+    [2] = { "data16" },
+    [3] = { "data" },
+    [4] = { "event_group" },
+    [7] = { "score" },
+    [8] = { "opponent_score" },
+    [9] = { "front_gear_num" },
+    [10] = { "front_gear" },
+    [11] = { "rear_gear_num" },
+    [12] = { "rear_gear" },
+    [13] = { "device_index" },
+    [21] = { "radar_threat_level_max" },
+    [22] = { "radar_threat_count" },
+};
+
+struct pfield pf_device_info[] = {
+    [0] = { "device_index" },
+    [1] = { "device_type" },
+    [2] = { "manufacturer" },
+    [3] = { "serial_number" },
+    [4] = { "product" },
+    [5] = { "software_version", 100 },
+    [6] = { "hardware_version" },
+    [7] = { "cum_operating_time", 0, 0, "s" },
+    [10] = { "battery_voltage", 256, 0, "V" },
+    [11] = { "battery_status" },
+    [18] = { "sensor_position" },
+    [19] = { "descriptor" },
+    [20] = { "ant_transmission_type" },
+    [21] = { "ant_device_number" },
+    [22] = { "ant_network" },
+    [25] = { "source_type" },
+    [27] = { "product_name" },
+    [32] = { "battery_level", 0, 0, "%" },
+};
+
+struct pfield pf_activity[] = {
+    [0] = { "total_timer_time", 1000, 0, "s" },
+    [1] = { "num_sessions" },
+    [2] = { "type" },
+    [3] = { "event" },
+    [4] = { "event_type" },
+    [5] = { "local_timestamp" },
+    [6] = { "event_group" },
+};
+
+struct pfield pf_software[] = {
+    [3] = { "version", 100 },
+    [5] = { "part_number" },
+};
+
+struct pfield pf_hrv[] = {
+    [0] = { "time", 1000, 0, "s" },
+};
+
+struct pfield pf_gps_metadata[] = {
+    [0] = { "timestamp_ms", 0, 0, "ms" },
+    [1] = { "position_lat", 0, 0, "semicircles" },
+    [2] = { "position_long", 0, 0, "semicircles" },
+    [3] = { "enhanced_altitude", 5, 500, "m" },
+    [4] = { "enhanced_speed", 1000, 0, "m/s" },
+    [5] = { "heading", 100, 0, "degrees" },
+    [6] = { "utc_timestamp", 0, 0, "date" },
+    [7] = { "velocity", 100, 0, "m/s" },
+};
+
+struct pfield pf_timestamp_correlation[] = {
+    [0] = { "fractional_timestamp", 32768, 0, "s" },
+    [1] = { "system_timestamp", 0, 0, "s" },
+    [2] = { "fractional_system_timestamp", 32768, 0, "s" },
+    [3] = { "local_timestamp", 0, 0, "s" },
+    [4] = { "timestamp_ms", 0, 0, "ms" },
+    [5] = { "system_timestamp_ms", 0, 0, "ms" },
+};
+
+struct pfield pf_field_description[] = {
+    [0] = { "developer_data_index" },
+    [1] = { "field_definition_number" },
+    [2] = { "fit_base_type_id" },
+    [3] = { "field_name" },
+    [4] = { "array" },
+    [5] = { "components" },
+    [6] = { "scale" },
+    [7] = { "offset" },
+    [8] = { "units" },
+    [9] = { "bits" },
+    [10] = { "accumulate" },
+    [13] = { "fit_base_unit_id" },
+    [14] = { "native_mesg_num" },
+    [15] = { "native_field_num" },
+};
+
+struct pfield pf_developer_data_id[] = {
+    [0] = { "developer_id" },
+    [1] = { "application_id" },
+    [2] = { "manufacturer_id" },
+    [3] = { "developer_data_index" },
+    [4] = { "application_version" },
+};
+
+#define PMESG(name, f)	{ name, f, sizeof(f) / sizeof(struct pfield) }
+#define PNAME(name)	{ name, NULL, 0 }
+
+struct pmesg profile[] = {
+    [0] = PMESG ( "file_id", pf_file_id ),
+    [1] = PNAME ( "capabilities" ),
+    [2] = PNAME ( "device_settings" ),
+    [3] = PNAME ( "user_profile" ),
+    [4] = PNAME ( "hrm_profile" ),
+    [5] = PNAME ( "sdm_profile" ),
+    [6] = PNAME ( "bike_profile" ),
+    [7] = PNAME ( "zones_target" ),
+    [8] = PNAME ( "hr_zone" ),
+    [9] = PNAME ( "power_zone" ),
+    [10] = PNAME ( "met_zone" ),
+    [12] = PMESG ( "sport", pf_sport ),
+    [15] = PNAME ( "goal" ),
+    [18] = PMESG ( "session", pf_session ),
+    [19] = PMESG ( "lap", pf_lap ),
+    [20] = PMESG ( "record", pf_record ),
+    [21] = PMESG ( "event", pf_event ),
+    [23] = PMESG ( "device_info", pf_device_info ),
+    [26] = PNAME ( "workout" ),
+    [27] = PNAME ( "workout_step" ),
+    [28] = PNAME ( "schedule" ),
+    [30] = PNAME ( "weight_scale" ),
+    [31] = PNAME ( "course" ),
+    [32] = PNAME ( "course_point" ),
+    [33] = PNAME ( "totals" ),
+    [34] = PMESG ( "activity", pf_activity ),
+    [35] = PMESG ( "software", pf_software ),
+    [37] = PNAME ( "file_capabilities" ),
+    [38] = PNAME ( "mesg_capabilities" ),
+    [39] = PNAME ( "field_capabilities" ),
+    [49] = PMESG ( "file_creator", pf_file_creator ),
+    [51] = PNAME ( "blood_pressure" ),
+    [53] = PNAME ( "speed_zone" ),
+    [55] = PNAME ( "monitoring" ),
+    [72] = PNAME ( "training_file" ),
+    [78] = PMESG ( "hrv", pf_hrv ),
+    [80] = PNAME ( "ant_rx" ),
+    [81] = PNAME ( "ant_tx" ),
+    [82] = PNAME ( "ant_channel_id" ),
+    [101] = PNAME ( "length" ),
+    [103] = PNAME ( "monitoring_info" ),
+    [105] = PNAME ( "pad" ),
+    [106] = PNAME ( "slave_device" ),
+    [127] = PNAME ( "connectivity" ),
+    [128] = PNAME ( "weather_conditions" ),
+    [129] = PNAME ( "weather_alert" ),
+    [131] = PNAME ( "cadence_zone" ),
+    [132] = PNAME ( "hr" ),
+    [142] = PNAME ( "segment_lap" ),
+    [145] = PNAME ( "memo_glob" ),
+    [148] = PNAME ( "segment_id" ),
+    [149] = PNAME ( "segment_leaderboard_entry" ),
+    [150] = PNAME ( "segment_point" ),
+    [151] = PNAME ( "segment_file" ),
+    [158] = PNAME ( "workout_session" ),
+    [159] = PNAME ( "watchface_settings" ),
+    [160] = PMESG ( "gps_metadata", pf_gps_metadata ),
+    [161] = PNAME ( "camera_event" ),
+    [162] = PMESG ( "timestamp_correlation", pf_timestamp_correlation ),
+    [164] = PNAME ( "gyroscope_data" ),
+    [165] = PNAME ( "accelerometer_data" ),
+    [167] = PNAME ( "three_d_sensor_calibration" ),
+    [169] = PNAME ( "video_frame" ),
+    [174] = PNAME ( "obdii_data" ),
+    [177] = PNAME ( "nmea_sentence" ),
+    [178] = PNAME ( "aviation_attitude" ),
+    [184] = PNAME ( "video" ),
+    [185] = PNAME ( "video_title" ),
+    [186] = PNAME ( "video_description" ),
+    [187] = PNAME ( "video_clip" ),
+    [188] = PNAME ( "ohr_settings" ),
+    [200] = PNAME ( "exd_screen_configuration" ),
+    [201] = PNAME ( "exd_data_field_configuration" ),
+    [202] = PNAME ( "exd_data_concept_configuration" ),
+    [206] = PMESG ( "field_description", pf_field_description ),
+    [207] = PMESG ( "developer_data_id", pf_developer_data_id ),
+    [208] = PNAME ( "magnetometer_data" ),
+    [209] = PNAME ( "barometer_data" ),
+    [210] = PNAME ( "one_d_sensor_calibration" ),
+    [211] = PNAME ( "monitoring_hr_data" ),
+    [216] = PNAME ( "time_in_zone" ),
+    [225] = PNAME ( "set" ),
+    [227] = PNAME ( "stress_level" ),
+    [229] = PNAME ( "dive_settings" ),
+    [258] = PNAME ( "dive_gas" ),
+    [259] = PNAME ( "dive_alarm" ),
+    [262] = PNAME ( "exercise_title" ),
+    [264] = PNAME ( "dive_summary" ),
+    [268] = PNAME ( "jump" ),
+    [285] = PNAME ( "spo2_data" ),
+    [290] = PNAME ( "beat_intervals" ),
+    [297] = PNAME ( "respiration_rate" ),
+    [312] = PNAME ( "split" ),
+    [313] = PNAME ( "split_summary" ),
+    [317] = PNAME ( "climb_pro" ),
+    [319] = PNAME ( "tank_update" ),
+    [323] = PNAME ( "tank_summary" ),
+    [346] = PNAME ( "sleep_assessment" ),
+    [370] = PNAME ( "hrv_status_summary" ),
+    [371] = PNAME ( "hrv_value" ),
+    [375] = PNAME ( "device_aux_battery_info" ),
+    [393] = PNAME ( "dive_apnea_alarm" ),
+};
+
+#define NPROFILE	(sizeof(profile) / sizeof(struct pmesg))
+
+/* Numbers from 0xff00 up are for manufacturers to use as they please */
+#define MESG_MFG_FIRST	0xff00
+
+/* THE END */